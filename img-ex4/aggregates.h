@@ -0,0 +1,131 @@
+/***************************************************************************
+ * Colour statistics computed directly on a quadtree, without decoding
+ *
+ * Each leaf contributes its colour weighted by the area of its block, so
+ * every query runs in O(leaves).  The tree covers a size x size square;
+ * only the width x height top-left part (the original image, without the
+ * padding added by PadToSquare) is counted.
+ ***************************************************************************/
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "image.h"
+#include "quadtree.h"
+
+// Call f(colour, area) for every leaf, area being the number of pixels of
+// its block inside the width x height image
+template <typename F>
+void ForEachLeaf(const QuadTree<Color>* qt, int x, int y, int size, int width, int height, F&& f)
+{
+    long w = std::min(x + size, width) - x;
+    long h = std::min(y + size, height) - y;
+    if (w <= 0 || h <= 0)
+        return;
+    if (qt->isLeaf()) {
+        f(qt->value(), w * h);
+        return;
+    }
+    int half = size / 2;
+    ForEachLeaf(qt->son(NW), x, y, half, width, height, f);
+    ForEachLeaf(qt->son(NE), x + half, y, half, width, height, f);
+    ForEachLeaf(qt->son(SE), x + half, y + half, half, width, height, f);
+    ForEachLeaf(qt->son(SW), x, y + half, half, width, height, f);
+}
+
+template <typename F>
+void ForEachLeaf(const QuadTree<Color>* qt, int size, int width, int height, F&& f)
+{
+    ForEachLeaf(qt, 0, 0, size, width, height, f);
+}
+
+// Per-channel histograms (number of pixels for each of the 256 levels)
+struct ColorHistogram {
+    std::array<long, 256> r{}, g{}, b{};
+};
+
+inline ColorHistogram Histogram(const QuadTree<Color>* qt, int size, int width, int height)
+{
+    ColorHistogram hist;
+    ForEachLeaf(qt, size, width, height, [&hist](const Color& c, long area) {
+        hist.r[c.r] += area;
+        hist.g[c.g] += area;
+        hist.b[c.b] += area;
+    });
+    return hist;
+}
+
+// Mean and variance of each channel
+struct ColorMoments {
+    double mean[3] = {0, 0, 0};
+    double variance[3] = {0, 0, 0};
+};
+
+inline ColorMoments Moments(const QuadTree<Color>* qt, int size, int width, int height)
+{
+    double sum[3] = {0, 0, 0}, sumSq[3] = {0, 0, 0};
+    long total = 0;
+    ForEachLeaf(qt, size, width, height, [&](const Color& c, long area) {
+        int ch[3] = {c.r, c.g, c.b};
+        for (int k = 0; k < 3; ++k) {
+            sum[k] += double(ch[k]) * area;
+            sumSq[k] += double(ch[k]) * ch[k] * area;
+        }
+        total += area;
+    });
+    ColorMoments m;
+    if (total == 0)
+        return m;
+    for (int k = 0; k < 3; ++k) {
+        m.mean[k] = sum[k] / total;
+        m.variance[k] = std::max(0.0, sumSq[k] / total - m.mean[k] * m.mean[k]);
+    }
+    return m;
+}
+
+inline Color MeanColor(const QuadTree<Color>* qt, int size, int width, int height)
+{
+    ColorMoments m = Moments(qt, size, width, height);
+    return {int(m.mean[0] + 0.5), int(m.mean[1] + 0.5), int(m.mean[2] + 0.5)};
+}
+
+// Number of pixels of each distinct colour, keyed by PackColor
+inline std::unordered_map<uint32_t, long> AreaPerColor(const QuadTree<Color>* qt, int size, int width, int height)
+{
+    std::unordered_map<uint32_t, long> areas;
+    ForEachLeaf(qt, size, width, height, [&areas](const Color& c, long area) {
+        areas[PackColor(c)] += area;
+    });
+    return areas;
+}
+
+// The k colours covering the largest areas, by decreasing area
+inline std::vector<std::pair<Color, long>> DominantColors(const QuadTree<Color>* qt, int size, int width, int height, size_t k)
+{
+    std::vector<std::pair<uint32_t, long>> areas;
+    for (const auto& a : AreaPerColor(qt, size, width, height))
+        areas.push_back(a);
+    k = std::min(k, areas.size());
+    std::partial_sort(areas.begin(), areas.begin() + k, areas.end(),
+                      [](const auto& a, const auto& b) { return a.second > b.second; });
+    std::vector<std::pair<Color, long>> dominant;
+    for (size_t i = 0; i < k; ++i)
+        dominant.push_back({UnpackColor(areas[i].first), areas[i].second});
+    return dominant;
+}
+
+// Number of pixels whose colour lies in [lo, hi] on every channel
+inline long AreaInRange(const QuadTree<Color>* qt, int size, int width, int height, const Color& lo, const Color& hi)
+{
+    long total = 0;
+    ForEachLeaf(qt, size, width, height, [&](const Color& c, long area) {
+        if (lo.r <= c.r && c.r <= hi.r && lo.g <= c.g && c.g <= hi.g && lo.b <= c.b && c.b <= hi.b)
+            total += area;
+    });
+    return total;
+}
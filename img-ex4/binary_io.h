@@ -0,0 +1,64 @@
+/***************************************************************************
+ * Little helpers shared by the binary file formats
+ *
+ * The readers throw runtime_error on truncated or malformed input.
+ ***************************************************************************/
+
+#pragma once
+
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include "image.h"
+
+namespace binary_io {
+
+inline void putVarint(std::ostream& os, uint32_t v) {
+    while (v >= 0x80) {
+        os.put(char((v & 0x7f) | 0x80));
+        v >>= 7;
+    }
+    os.put(char(v));
+}
+
+inline uint32_t getVarint(std::istream& is) {
+    uint32_t v = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        int b = is.get();
+        if (b == EOF) throw std::runtime_error("Truncated stream");
+        v |= uint32_t(b & 0x7f) << shift;
+        if (!(b & 0x80)) return v;
+    }
+    throw std::runtime_error("Bad varint in stream");
+}
+
+// uint32 in little endian
+inline void putU32(std::ostream& os, uint32_t v) {
+    for (int i = 0; i < 4; ++i) os.put(char((v >> (8 * i)) & 0xff));
+}
+
+inline uint32_t getU32(std::istream& is) {
+    uint32_t v = 0;
+    for (int i = 0; i < 4; ++i) {
+        int b = is.get();
+        if (b == EOF) throw std::runtime_error("Truncated stream");
+        v |= uint32_t(b) << (8 * i);
+    }
+    return v;
+}
+
+// A colour as 3 bytes r, g, b
+inline void putColor(std::ostream& os, const Color& c) {
+    os.put(char(c.r));
+    os.put(char(c.g));
+    os.put(char(c.b));
+}
+
+inline Color getColor(std::istream& is) {
+    unsigned char rgb[3];
+    if (!is.read(reinterpret_cast<char*>(rgb), 3)) throw std::runtime_error("Truncated stream");
+    return {rgb[0], rgb[1], rgb[2]};
+}
+
+} // namespace binary_io
@@ -0,0 +1,211 @@
+/***************************************************************************
+ * Binary space partition of an image
+ *
+ * Instead of the 4 equal quadrants of the quadtree, each node cuts its
+ * rectangle in two, horizontally or vertically, at the position that most
+ * reduces the colour variance.  Candidate cuts are evaluated in O(1) each
+ * from summed-area tables, so axis-aligned rectangles are captured by few
+ * leaves wherever they are.  Works on images of any size (no padding).
+ ***************************************************************************/
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "image.h"
+#include "binary_io.h"
+
+struct BspNode {
+    // Leaf: the colour of the whole rectangle
+    Color color{0, 0, 0};
+    // Node: the cut and the two parts (left/top first, right/bottom second)
+    bool vertical = false;   // cut along a column (true) or a row (false)
+    int cut = 0;             // width (vertical) or height (horizontal) of the first part
+    std::unique_ptr<BspNode> first;
+    std::unique_ptr<BspNode> second;
+
+    bool isLeaf() const { return !first; }
+
+    int nLeaves() const { return isLeaf() ? 1 : first->nLeaves() + second->nLeaves(); }
+};
+
+/*--------------------------------------------------------------------------*
+ * Summed-area tables of the channels and of their squares, to get the sum
+ * of squared errors to the mean of any rectangle in O(1)
+ *--------------------------------------------------------------------------*/
+class RectStats {
+public:
+    explicit RectStats(const std::vector<std::vector<Color>>& img)
+        : w(img.empty() ? 0 : img[0].size()), h(img.size()), sums(4, std::vector<int64_t>(size_t(w + 1) * (h + 1), 0))
+    {
+        for (int y = 0; y < h; ++y)
+            for (int x = 0; x < w; ++x) {
+                const Color& c = img[y][x];
+                int64_t v[4] = {c.r, c.g, c.b, int64_t(c.r) * c.r + int64_t(c.g) * c.g + int64_t(c.b) * c.b};
+                for (int k = 0; k < 4; ++k) {
+                    std::vector<int64_t>& t = sums[k];
+                    t[idx(x + 1, y + 1)] = v[k] + t[idx(x, y + 1)] + t[idx(x + 1, y)] - t[idx(x, y)];
+                }
+            }
+    }
+
+    // Sum of squared distances to the mean colour, over the rectangle
+    double sse(int x, int y, int rw, int rh) const
+    {
+        double area = double(rw) * rh;
+        double r = sum(0, x, y, rw, rh), g = sum(1, x, y, rw, rh), b = sum(2, x, y, rw, rh);
+        return sum(3, x, y, rw, rh) - (r * r + g * g + b * b) / area;
+    }
+
+private:
+    int w, h;
+    std::vector<std::vector<int64_t>> sums;
+
+    size_t idx(int x, int y) const { return size_t(y) * (w + 1) + x; }
+
+    double sum(int k, int x, int y, int rw, int rh) const {
+        const std::vector<int64_t>& t = sums[k];
+        return double(t[idx(x + rw, y + rh)] - t[idx(x, y + rh)] - t[idx(x + rw, y)] + t[idx(x, y)]);
+    }
+};
+
+// Same test as isUniform, on a rectangle
+inline bool isUniformRect(const std::vector<std::vector<Color>>& img, int x, int y, int w, int h, int tolerance) {
+    const Color& ref = img[y][x];
+    for (int j = y; j < y + h; ++j)
+        for (int i = x; i < x + w; ++i) {
+            const Color& c = img[j][i];
+            int dr = ref.r - c.r;
+            int dg = ref.g - c.g;
+            int db = ref.b - c.b;
+            if (dr * dr + dg * dg + db * db > tolerance * tolerance)
+                return false;
+        }
+    return true;
+}
+
+inline std::unique_ptr<BspNode> EncodeBsp(const std::vector<std::vector<Color>>& img, const RectStats& stats,
+                                          int x, int y, int w, int h, int tolerance) {
+    auto node = std::make_unique<BspNode>();
+    if (isUniformRect(img, x, y, w, h, tolerance)) {
+        node->color = img[y][x];
+        return node;
+    }
+
+    // Pick the cut minimizing the total squared error of the two parts
+    double best = -1;
+    for (int c = 1; c < w; ++c) {
+        double e = stats.sse(x, y, c, h) + stats.sse(x + c, y, w - c, h);
+        if (best < 0 || e < best) {
+            best = e;
+            node->vertical = true;
+            node->cut = c;
+        }
+    }
+    for (int c = 1; c < h; ++c) {
+        double e = stats.sse(x, y, w, c) + stats.sse(x, y + c, w, h - c);
+        if (best < 0 || e < best) {
+            best = e;
+            node->vertical = false;
+            node->cut = c;
+        }
+    }
+
+    if (node->vertical) {
+        node->first = EncodeBsp(img, stats, x, y, node->cut, h, tolerance);
+        node->second = EncodeBsp(img, stats, x + node->cut, y, w - node->cut, h, tolerance);
+    } else {
+        node->first = EncodeBsp(img, stats, x, y, w, node->cut, tolerance);
+        node->second = EncodeBsp(img, stats, x, y + node->cut, w, h - node->cut, tolerance);
+    }
+    return node;
+}
+
+inline std::unique_ptr<BspNode> EncodeBsp(const Image& img, int tolerance = 10) {
+    RectStats stats(img.data);
+    return EncodeBsp(img.data, stats, 0, 0, img.width(), img.height(), tolerance);
+}
+
+inline void DecodeBsp(std::vector<std::vector<Color>>& img, const BspNode* node, int x, int y, int w, int h) {
+    if (node->isLeaf()) {
+        for (int j = y; j < y + h; ++j)
+            std::fill(img[j].begin() + x, img[j].begin() + x + w, node->color);
+    } else if (node->vertical) {
+        DecodeBsp(img, node->first.get(), x, y, node->cut, h);
+        DecodeBsp(img, node->second.get(), x + node->cut, y, w - node->cut, h);
+    } else {
+        DecodeBsp(img, node->first.get(), x, y, w, node->cut);
+        DecodeBsp(img, node->second.get(), x, y + node->cut, w, h - node->cut);
+    }
+}
+
+/*--------------------------------------------------------------------------*
+ * Serialization
+ *
+ * Header "BSP1", width and height (uint32 little endian), then the nodes in
+ * preorder: tag 0 followed by r, g, b bytes for a leaf, tag 1 (vertical) or
+ * 2 (horizontal) followed by the cut as a varint for a node.
+ *--------------------------------------------------------------------------*/
+namespace bsp_io {
+
+inline void writeNode(std::ostream& os, const BspNode* node) {
+    if (node->isLeaf()) {
+        os.put(0);
+        binary_io::putColor(os, node->color);
+        return;
+    }
+    os.put(node->vertical ? 1 : 2);
+    binary_io::putVarint(os, node->cut);
+    writeNode(os, node->first.get());
+    writeNode(os, node->second.get());
+}
+
+inline std::unique_ptr<BspNode> readNode(std::istream& is, int w, int h) {
+    auto node = std::make_unique<BspNode>();
+    int tag = is.get();
+    if (tag == 0) {
+        node->color = binary_io::getColor(is);
+        return node;
+    }
+    if (tag != 1 && tag != 2) throw std::runtime_error("Bad node tag in BSP stream");
+    node->vertical = (tag == 1);
+    node->cut = int(binary_io::getVarint(is));
+    int extent = node->vertical ? w : h;
+    if (node->cut <= 0 || node->cut >= extent) throw std::runtime_error("Bad cut in BSP stream");
+    if (node->vertical) {
+        node->first = readNode(is, node->cut, h);
+        node->second = readNode(is, w - node->cut, h);
+    } else {
+        node->first = readNode(is, w, node->cut);
+        node->second = readNode(is, w, h - node->cut);
+    }
+    return node;
+}
+
+} // namespace bsp_io
+
+inline void WriteBsp(std::ostream& os, const BspNode* root, int width, int height) {
+    os.write("BSP1", 4);
+    binary_io::putU32(os, width);
+    binary_io::putU32(os, height);
+    bsp_io::writeNode(os, root);
+}
+
+// Read a tree written by WriteBsp, and the size of the image it covers
+// Throw runtime_error on malformed input
+inline std::unique_ptr<BspNode> ReadBsp(std::istream& is, int& width, int& height) {
+    char magic[4];
+    if (!is.read(magic, 4) || std::string(magic, 4) != "BSP1")
+        throw std::runtime_error("Not a BSP stream");
+    width = int(binary_io::getU32(is));
+    height = int(binary_io::getU32(is));
+    if (width <= 0 || height <= 0 || width > MaxTreeSize || height > MaxTreeSize)
+        throw std::runtime_error("Bad image size in BSP stream");
+    return bsp_io::readNode(is, width, height);
+}
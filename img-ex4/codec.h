@@ -0,0 +1,118 @@
+#pragma once
+
+#include <cstring>
+#include <vector>
+#include "image.h"
+#include "quadtree.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+inline bool isUniform(const std::vector<std::vector<Color>>& img, int x, int y, int size, int tolerance = 10) {
+    const Color& ref = img[y][x];
+    for (int j = y; j < y + size; ++j)
+        for (int i = x; i < x + size; ++i) {
+            const Color& c = img[j][i];
+            int dr = ref.r - c.r;
+            int dg = ref.g - c.g;
+            int db = ref.b - c.b;
+            if (dr * dr + dg * dg + db * db > tolerance * tolerance)
+                return false;
+        }
+    return true;
+}
+
+// Colors are compared as raw words in lossless mode
+static_assert(sizeof(Color) == 3 * sizeof(int), "Color must not be padded");
+
+// Exact version of isUniform (tolerance 0) working on whole rows:
+// the first row is uniform iff it equals itself shifted by one pixel,
+// and every other row must then be bytewise equal to the first one
+inline bool isUniformExact(const std::vector<std::vector<Color>>& img, int x, int y, int size) {
+    const Color* first = img[y].data() + x;
+    size_t rowBytes = size * sizeof(Color);
+    if (std::memcmp(first + 1, first, rowBytes - sizeof(Color)) != 0)
+        return false;
+    for (int j = y + 1; j < y + size; ++j)
+        if (std::memcmp(img[j].data() + x, first, rowBytes) != 0)
+            return false;
+    return true;
+}
+
+// Only the subtrees covering at least this many pixels get trace spans
+const int traceMinPixels = 256 * 256;
+
+// A tolerance of 0 gives a lossless encoding
+inline QuadTree<Color>* Encode(const std::vector<std::vector<Color>>& img, int x, int y, int size, int tolerance = 10) {
+    TraceSpan span(size * size >= traceMinPixels ? "Encode" : nullptr, size);
+    if (tolerance == 0 ? isUniformExact(img, x, y, size) : isUniform(img, x, y, size, tolerance))
+        return new QuadLeaf<Color>(img[y][x]);
+
+    int half = size / 2;
+    return new QuadNode<Color>(
+        Encode(img, x, y, half, tolerance),
+        Encode(img, x + half, y, half, tolerance),
+        Encode(img, x + half, y + half, half, tolerance),
+        Encode(img, x, y + half, half, tolerance)
+    );
+}
+
+inline void Decode(std::vector<std::vector<Color>>& img, QuadTree<Color>* node, int x, int y, int size) {
+    TraceSpan span(size * size >= traceMinPixels ? "Decode" : nullptr, size);
+    if (node->isLeaf()) {
+        Color c = node->value();
+        for (int j = y; j < y + size; ++j)
+            for (int i = x; i < x + size; ++i)
+                img[j][i] = c;
+    } else {
+        int half = size / 2;
+        Decode(img, node->son(NW), x, y, half);
+        Decode(img, node->son(NE), x + half, y, half);
+        Decode(img, node->son(SE), x + half, y + half, half);
+        Decode(img, node->son(SW), x, y + half, half);
+    }
+}
+
+// Blocks of at most this many pixels are decoded by a single task
+const int parallelDecodeGrain = 128 * 128;
+
+// Fill the size x size block at (x, y) with c, splitting big fills into
+// quadrant tasks so that a huge uniform leaf does not serialize the decode
+inline void FillParallel(std::vector<std::vector<Color>>& img, Color c, int x, int y, int size, TaskGroup& tasks) {
+    if (size * size <= parallelDecodeGrain) {
+        for (int j = y; j < y + size; ++j)
+            std::fill(img[j].begin() + x, img[j].begin() + x + size, c);
+        return;
+    }
+    int half = size / 2;
+    tasks.run([&img, c, x, y, half, &tasks] { FillParallel(img, c, x, y, half, tasks); });
+    tasks.run([&img, c, x, y, half, &tasks] { FillParallel(img, c, x + half, y, half, tasks); });
+    tasks.run([&img, c, x, y, half, &tasks] { FillParallel(img, c, x + half, y + half, half, tasks); });
+    FillParallel(img, c, x, y + half, half, tasks);
+}
+
+// Fork one task per quadrant as long as the quadrant covers more pixels
+// than the grain; the quadrants write disjoint regions of img
+inline void DecodeParallel(std::vector<std::vector<Color>>& img, QuadTree<Color>* node, int x, int y, int size, TaskGroup& tasks) {
+    if (size * size <= parallelDecodeGrain) {
+        Decode(img, node, x, y, size);
+        return;
+    }
+    if (node->isLeaf()) {
+        FillParallel(img, node->value(), x, y, size, tasks);
+        return;
+    }
+    int half = size / 2;
+    tasks.run([&img, node, x, y, half, &tasks] { DecodeParallel(img, node->son(NW), x, y, half, tasks); });
+    tasks.run([&img, node, x, y, half, &tasks] { DecodeParallel(img, node->son(NE), x + half, y, half, tasks); });
+    tasks.run([&img, node, x, y, half, &tasks] { DecodeParallel(img, node->son(SE), x + half, y + half, half, tasks); });
+    DecodeParallel(img, node->son(SW), x, y + half, half, tasks);
+}
+
+// Same result as Decode, with the work distributed over a work-stealing pool
+inline void ParallelDecode(std::vector<std::vector<Color>>& img, QuadTree<Color>* node, int x, int y, int size,
+                           WorkStealingPool& pool = WorkStealingPool::global()) {
+    TraceSpan span("ParallelDecode", size);
+    TaskGroup tasks(pool);
+    DecodeParallel(img, node, x, y, size, tasks);
+    tasks.wait();
+}
@@ -0,0 +1,253 @@
+/***************************************************************************
+ * Dictionary of quadtree subtrees shared by a whole corpus of images
+ *
+ * Every subtree is hash-consed: a leaf is identified by its colour and a
+ * node by the ids of its 4 sons, so identical subtrees, within an image or
+ * across images, are stored once.  Each image is then just a reference
+ * (size and root id) into the dictionary.
+ ***************************************************************************/
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "image.h"
+#include "binary_io.h"
+#include "quadtree.h"
+
+class SubtreeDictionary {
+public:
+    using Id = uint32_t;
+
+    struct Entry {
+        bool leaf;
+        Color color;            // leaf only
+        Id sons[nQuadDir];      // node only, always smaller than the id of the node
+        int64_t nLeaves;        // number of leaves of the subtree (64 bits: sons may be shared)
+    };
+
+    // Add the subtree (if new) and return its id
+    Id intern(const QuadTree<Color>* qt)
+    {
+        Entry e{};
+        if (qt->isLeaf()) {
+            e.leaf = true;
+            e.color = qt->value();
+            e.nLeaves = 1;
+        } else {
+            e.leaf = false;
+            for (int d = 0; d < nQuadDir; d++) {
+                e.sons[d] = intern(qt->son(d));
+                e.nLeaves += entries[e.sons[d]].nLeaves;
+            }
+        }
+        return add(e);
+    }
+
+    size_t size() const { return entries.size(); }
+
+    const Entry& entry(Id id) const { return entries[id]; }
+
+    // Rebuild a standalone quadtree for the subtree id
+    QuadTree<Color>* expand(Id id) const
+    {
+        const Entry& e = entries[id];
+        if (e.leaf)
+            return new QuadLeaf<Color>(e.color);
+        return new QuadNode<Color>(expand(e.sons[NW]), expand(e.sons[NE]), expand(e.sons[SE]), expand(e.sons[SW]));
+    }
+
+    // Format: "QTD1", number of entries, then each entry in id order: tag 0
+    // and the colour for a leaf, tag 1 and the 4 (id - son id) varints for a node
+    void write(std::ostream& os) const
+    {
+        os.write("QTD1", 4);
+        binary_io::putU32(os, entries.size());
+        for (Id id = 0; id < entries.size(); id++) {
+            const Entry& e = entries[id];
+            if (e.leaf) {
+                os.put(0);
+                binary_io::putColor(os, e.color);
+            } else {
+                os.put(1);
+                for (int d = 0; d < nQuadDir; d++)
+                    binary_io::putVarint(os, id - e.sons[d]);
+            }
+        }
+    }
+
+    // Throw runtime_error on malformed input
+    static SubtreeDictionary read(std::istream& is)
+    {
+        char magic[4];
+        if (!is.read(magic, 4) || std::string(magic, 4) != "QTD1")
+            throw std::runtime_error("Not a subtree dictionary");
+        SubtreeDictionary dict;
+        uint32_t n = binary_io::getU32(is);
+        for (Id id = 0; id < n; id++) {
+            Entry e{};
+            int tag = is.get();
+            if (tag == 0) {
+                e.leaf = true;
+                e.color = binary_io::getColor(is);
+                e.nLeaves = 1;
+            } else if (tag == 1) {
+                for (int d = 0; d < nQuadDir; d++) {
+                    uint32_t delta = binary_io::getVarint(is);
+                    if (delta == 0 || delta > id)
+                        throw std::runtime_error("Bad son reference in subtree dictionary");
+                    e.sons[d] = id - delta;
+                    e.nLeaves += dict.entries[e.sons[d]].nLeaves;
+                }
+                // Sharing sons lets a few entries describe a huge tree: no
+                // image read back may have more leaves than MaxTreeSize^2 pixels
+                if (e.nLeaves > int64_t(MaxTreeSize) * MaxTreeSize)
+                    throw std::runtime_error("Subtree too big in subtree dictionary");
+            } else {
+                throw std::runtime_error("Bad entry tag in subtree dictionary");
+            }
+            if (dict.add(e) != id)
+                throw std::runtime_error("Duplicate entry in subtree dictionary");
+        }
+        return dict;
+    }
+
+private:
+    struct KeyHash {
+        size_t operator()(const Entry& e) const {
+            size_t h = e.leaf ? std::hash<uint32_t>()(PackColor(e.color)) : 0x9e3779b9;
+            if (!e.leaf)
+                for (int d = 0; d < nQuadDir; d++)
+                    h ^= std::hash<Id>()(e.sons[d]) + 0x9e3779b9 + (h << 6) + (h >> 2);
+            return h;
+        }
+    };
+
+    struct KeyEqual {
+        bool operator()(const Entry& a, const Entry& b) const {
+            if (a.leaf != b.leaf) return false;
+            if (a.leaf) return a.color == b.color;
+            return std::memcmp(a.sons, b.sons, sizeof(a.sons)) == 0;
+        }
+    };
+
+    std::vector<Entry> entries;
+    std::unordered_map<Entry, Id, KeyHash, KeyEqual> index;
+
+    Id add(const Entry& e)
+    {
+        auto [it, inserted] = index.emplace(e, Id(entries.size()));
+        if (inserted)
+            entries.push_back(e);
+        return it->second;
+    }
+};
+
+/*--------------------------------------------------------------------------*
+ * An image stored as a reference into a dictionary
+ *--------------------------------------------------------------------------*/
+struct SharedImageRef {
+    int width;      // size of the original image
+    int height;
+    int size;       // side of the (padded) square covered by the tree
+    SubtreeDictionary::Id root;
+};
+
+inline void WriteImageRef(std::ostream& os, const SharedImageRef& ref) {
+    os.write("QTR1", 4);
+    binary_io::putU32(os, ref.width);
+    binary_io::putU32(os, ref.height);
+    binary_io::putU32(os, ref.size);
+    binary_io::putU32(os, ref.root);
+}
+
+// Throw runtime_error on malformed input
+inline SharedImageRef ReadImageRef(std::istream& is, const SubtreeDictionary& dict) {
+    char magic[4];
+    if (!is.read(magic, 4) || std::string(magic, 4) != "QTR1")
+        throw std::runtime_error("Not an image reference");
+    SharedImageRef ref;
+    ref.width = int(binary_io::getU32(is));
+    ref.height = int(binary_io::getU32(is));
+    ref.size = int(binary_io::getU32(is));
+    ref.root = binary_io::getU32(is);
+    if (!IsValidTreeSize(ref.size))
+        throw std::runtime_error("Bad size in image reference");
+    if (ref.width <= 0 || ref.height <= 0 || ref.width > ref.size || ref.height > ref.size)
+        throw std::runtime_error("Bad image size in image reference");
+    if (ref.root >= dict.size())
+        throw std::runtime_error("Image reference out of the dictionary");
+    return ref;
+}
+
+/*--------------------------------------------------------------------------*
+ * Decoder keeping the pixels of shared subtrees, so that a subtree used
+ * several times (in one image or across images) is decoded only once
+ *--------------------------------------------------------------------------*/
+class DictionaryDecoder {
+public:
+    // Only cache subtrees that are sons of several nodes and have at least
+    // minCachedLeaves leaves, and stop caching beyond maxCachedPixels
+    explicit DictionaryDecoder(const SubtreeDictionary& dict, int minCachedLeaves = 16, size_t maxCachedPixels = 1 << 22)
+        : dict(dict), minCachedLeaves(minCachedLeaves), maxCachedPixels(maxCachedPixels), parents(dict.size(), 0)
+    {
+        for (SubtreeDictionary::Id id = 0; id < dict.size(); id++)
+            if (!dict.entry(id).leaf)
+                for (int d = 0; d < nQuadDir; d++)
+                    parents[dict.entry(id).sons[d]]++;
+    }
+
+    void decode(std::vector<std::vector<Color>>& img, SubtreeDictionary::Id id, int x, int y, int size)
+    {
+        const SubtreeDictionary::Entry& e = dict.entry(id);
+        if (e.leaf) {
+            for (int j = y; j < y + size; ++j)
+                std::fill(img[j].begin() + x, img[j].begin() + x + size, e.color);
+            return;
+        }
+        bool cacheable = parents[id] > 1 && e.nLeaves >= minCachedLeaves;
+        uint64_t key = (uint64_t(id) << 32) | uint32_t(size);
+        if (cacheable) {
+            auto it = cache.find(key);
+            if (it != cache.end()) {
+                nHits++;
+                const Color* block = it->second.data();
+                for (int j = 0; j < size; ++j)
+                    std::copy(block + j * size, block + (j + 1) * size, img[y + j].begin() + x);
+                return;
+            }
+        }
+        int half = size / 2;
+        decode(img, e.sons[NW], x, y, half);
+        decode(img, e.sons[NE], x + half, y, half);
+        decode(img, e.sons[SE], x + half, y + half, half);
+        decode(img, e.sons[SW], x, y + half, half);
+        if (cacheable && cachedPixels + size_t(size) * size <= maxCachedPixels) {
+            std::vector<Color>& block = cache[key];
+            block.reserve(size_t(size) * size);
+            for (int j = y; j < y + size; ++j)
+                block.insert(block.end(), img[j].begin() + x, img[j].begin() + x + size);
+            cachedPixels += size_t(size) * size;
+        }
+    }
+
+    // Number of cache hits
+    size_t hits() const { return nHits; }
+
+private:
+    const SubtreeDictionary& dict;
+    int minCachedLeaves;
+    size_t maxCachedPixels;
+    std::vector<int> parents;   // number of nodes having each entry as a son
+    size_t cachedPixels = 0;
+    size_t nHits = 0;
+    std::unordered_map<uint64_t, std::vector<Color>> cache;
+};
@@ -0,0 +1,179 @@
+/***************************************************************************
+ * Hybrid quadtree: blocks at or below a given size that are not uniform
+ * are stored as quantized DCT coefficients instead of being split further
+ *
+ * This caps the depth of the tree on noisy images, where the plain
+ * quadtree descends down to single pixels.
+ ***************************************************************************/
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <numbers>
+#include <vector>
+#include "image.h"
+#include "codec.h"
+#include "quadtree.h"
+
+// Largest supported transform-coded block
+const int maxHybridBlockSize = 32;
+
+/*--------------------------------------------------------------------------*
+ * Orthonormal DCT-II basis for n x n blocks: basis[k * n + i] is the value
+ * of frequency k at sample i; transposed is its transpose
+ *--------------------------------------------------------------------------*/
+struct DctBasis {
+    std::vector<float> basis;
+    std::vector<float> transposed;
+
+    static const DctBasis& get(int n)
+    {
+        static DctBasis bases[maxHybridBlockSize + 1];
+        static std::once_flag done[maxHybridBlockSize + 1];
+        std::call_once(done[n], [n] {
+            DctBasis& d = bases[n];
+            d.basis.resize(n * n);
+            d.transposed.resize(n * n);
+            for (int k = 0; k < n; ++k) {
+                double scale = std::sqrt((k == 0 ? 1.0 : 2.0) / n);
+                for (int i = 0; i < n; ++i) {
+                    float v = float(scale * std::cos(std::numbers::pi * (2 * i + 1) * k / (2.0 * n)));
+                    d.basis[k * n + i] = v;
+                    d.transposed[i * n + k] = v;
+                }
+            }
+        });
+        return bases[n];
+    }
+};
+
+// out = a * b for n x n row-major matrices
+// The inner loop runs over contiguous rows so that it vectorizes
+inline void MatMul(const float* a, const float* b, float* out, int n)
+{
+    for (int i = 0; i < n; ++i) {
+        float* row = out + i * n;
+        std::fill(row, row + n, 0.0f);
+        for (int k = 0; k < n; ++k) {
+            float aik = a[i * n + k];
+            const float* bk = b + k * n;
+            for (int j = 0; j < n; ++j)
+                row[j] += aik * bk[j];
+        }
+    }
+}
+
+// Forward 2D DCT: coeffs = B * block * B^T (tmp holds n * n floats)
+inline void ForwardDct(const float* block, float* coeffs, float* tmp, int n)
+{
+    const DctBasis& d = DctBasis::get(n);
+    MatMul(d.basis.data(), block, tmp, n);
+    MatMul(tmp, d.transposed.data(), coeffs, n);
+}
+
+// Inverse 2D DCT: block = B^T * coeffs * B (tmp holds n * n floats)
+inline void InverseDct(const float* coeffs, float* block, float* tmp, int n)
+{
+    const DctBasis& d = DctBasis::get(n);
+    MatMul(d.transposed.data(), coeffs, tmp, n);
+    MatMul(tmp, d.basis.data(), block, n);
+}
+
+/*--------------------------------------------------------------------------*
+ * A transform-coded block: quantized DCT coefficients of the 3 channels
+ *--------------------------------------------------------------------------*/
+struct CodedBlock {
+    int size;
+    float step;                          // quantization step
+    std::vector<int16_t> coeffs[3];      // size * size coefficients per channel
+};
+
+// Value of a hybrid leaf: a flat colour, or a coded block when block is set
+// (the block is shared so that copying the value stays cheap)
+struct HybridColor {
+    Color color;
+    std::shared_ptr<const CodedBlock> block;
+};
+
+inline std::shared_ptr<const CodedBlock> CodeBlock(const std::vector<std::vector<Color>>& img, int x, int y, int size, float step)
+{
+    auto coded = std::make_shared<CodedBlock>();
+    coded->size = size;
+    coded->step = step;
+    std::vector<float> block(size * size), coeffs(size * size), tmp(size * size);
+    for (int k = 0; k < 3; ++k) {
+        for (int j = 0; j < size; ++j)
+            for (int i = 0; i < size; ++i) {
+                const Color& c = img[y + j][x + i];
+                // Center the samples so that the DC coefficient stays small
+                block[j * size + i] = float((k == 0 ? c.r : k == 1 ? c.g : c.b) - 128);
+            }
+        ForwardDct(block.data(), coeffs.data(), tmp.data(), size);
+        coded->coeffs[k].resize(size * size);
+        for (int i = 0; i < size * size; ++i)
+            coded->coeffs[k][i] = int16_t(std::lround(coeffs[i] / step));
+    }
+    return coded;
+}
+
+inline void DecodeBlock(std::vector<std::vector<Color>>& img, const CodedBlock& coded, int x, int y)
+{
+    int size = coded.size;
+    std::vector<float> coeffs(size * size), tmp(size * size), block[3];
+    for (int k = 0; k < 3; ++k) {
+        for (int i = 0; i < size * size; ++i)
+            coeffs[i] = coded.coeffs[k][i] * coded.step;
+        block[k].resize(size * size);
+        InverseDct(coeffs.data(), block[k].data(), tmp.data(), size);
+    }
+    for (int j = 0; j < size; ++j)
+        for (int i = 0; i < size; ++i) {
+            int idx = j * size + i;
+            img[y + j][x + i] = {
+                std::clamp(int(std::lround(block[0][idx])) + 128, 0, 255),
+                std::clamp(int(std::lround(block[1][idx])) + 128, 0, 255),
+                std::clamp(int(std::lround(block[2][idx])) + 128, 0, 255)
+            };
+        }
+}
+
+// Encode as the plain quadtree, except that non-uniform blocks of at most
+// blockSize pixels wide are transform coded with the given quantization step
+inline QuadTree<HybridColor>* EncodeHybrid(const std::vector<std::vector<Color>>& img, int x, int y, int size,
+                                           int tolerance = 10, int blockSize = 8, float step = 8.0f) {
+    if (isUniform(img, x, y, size, tolerance))
+        return new QuadLeaf<HybridColor>({img[y][x], nullptr});
+
+    if (size <= std::min(blockSize, maxHybridBlockSize))
+        return new QuadLeaf<HybridColor>({img[y][x], CodeBlock(img, x, y, size, step)});
+
+    int half = size / 2;
+    return new QuadNode<HybridColor>(
+        EncodeHybrid(img, x, y, half, tolerance, blockSize, step),
+        EncodeHybrid(img, x + half, y, half, tolerance, blockSize, step),
+        EncodeHybrid(img, x + half, y + half, half, tolerance, blockSize, step),
+        EncodeHybrid(img, x, y + half, half, tolerance, blockSize, step)
+    );
+}
+
+inline void DecodeHybrid(std::vector<std::vector<Color>>& img, QuadTree<HybridColor>* node, int x, int y, int size) {
+    if (node->isLeaf()) {
+        const HybridColor& v = node->value();
+        if (v.block) {
+            DecodeBlock(img, *v.block, x, y);
+            return;
+        }
+        for (int j = y; j < y + size; ++j)
+            std::fill(img[j].begin() + x, img[j].begin() + x + size, v.color);
+    } else {
+        int half = size / 2;
+        DecodeHybrid(img, node->son(NW), x, y, half);
+        DecodeHybrid(img, node->son(NE), x + half, y, half);
+        DecodeHybrid(img, node->son(SE), x + half, y + half, half);
+        DecodeHybrid(img, node->son(SW), x, y + half, half);
+    }
+}
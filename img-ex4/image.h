@@ -0,0 +1,85 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+
+struct Color {
+    int r, g, b;
+
+    bool operator==(const Color& other) const {
+        return r == other.r && g == other.g && b == other.b;
+    }
+};
+
+// Colour as a 0xRRGGBB integer, e.g. as a hash key
+inline uint32_t PackColor(const Color& c) {
+    return (uint32_t(c.r) << 16) | (uint32_t(c.g) << 8) | uint32_t(c.b);
+}
+
+inline Color UnpackColor(uint32_t rgb) {
+    return {int(rgb >> 16), int((rgb >> 8) & 0xff), int(rgb & 0xff)};
+}
+
+class Image {
+public:
+    std::vector<std::vector<Color>> data;
+    int w_;
+    int h_;
+
+    Image() : w_(0), h_(0) {}
+
+    Image(int width, int height)
+        : data(height, std::vector<Color>(width)), w_(width), h_(height) {}
+
+    int width() const { return data.empty() ? 0 : data[0].size(); }
+    int height() const { return data.size(); }
+
+    Color& at(int x, int y) { return data[y][x]; }
+    const Color& at(int x, int y) const { return data[y][x]; }
+
+    Image Resize(int w, int h) const {
+        Image trimmed(w, h);
+        for (int y = 0; y < h; ++y)
+            for (int x = 0; x < w; ++x)
+                if (x < w_ && y < h_)
+                    trimmed.at(x, y) = this->at(x, y);
+                else
+                    trimmed.at(x, y) = {0, 0, 0}; // Fill with black if out of bounds
+        return trimmed;
+    }
+};
+
+inline bool IsPowerOfTwo(int x) {
+    return x > 0 && (x & (x - 1)) == 0;
+}
+
+// Largest side of the image covered by a tree read from a file, so that a
+// corrupt size cannot make the decoder allocate gigabytes
+const int MaxTreeSize = 1 << 14;
+
+// Side of a square a stored tree may cover
+inline bool IsValidTreeSize(int size) {
+    return IsPowerOfTwo(size) && size <= MaxTreeSize;
+}
+
+inline bool IsValidImageSize(const Image& img) {
+    return img.width() == img.height() && IsPowerOfTwo(img.width());
+}
+
+inline Image PadToSquare(const Image& input) {
+    int h = input.height();
+    int w = input.width();
+    int size = 1;
+    while (size < std::max(w, h)) size *= 2;
+
+    Image padded(size, size);
+    padded.w_ = w;
+    padded.h_ = h;
+
+    for (int y = 0; y < h; ++y)
+        for (int x = 0; x < w; ++x)
+            padded.at(x, y) = input.at(x, y);
+
+    return padded;
+}
@@ -1,76 +1,34 @@
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
 #include <string>
 #include <vector>
 #include <iostream>
 #include <stdexcept>
 #include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
 #include "quadtree.h"
+#include "image.h"
+#include "codec.h"
+#include "planar.h"
+#include "hybrid.h"
+#include "bsp.h"
+#include "dictionary.h"
+#include "aggregates.h"
+#include "transforms.h"
+#include "quality.h"
+#include "persistent_quadtree.h"
+#include "succinct.h"
+#include "perf_counters.h"
 #include "stb_image.h"
 #include "stb_image_write.h"
 
 namespace fs = std::filesystem;
 
-struct Color {
-    int r, g, b;
-
-    bool operator==(const Color& other) const {
-        return r == other.r && g == other.g && b == other.b;
-    }
-};
-
-class Image {
-public:
-    std::vector<std::vector<Color>> data;
-    int w_;
-    int h_;
-
-    Image() : w_(0), h_(0) {}
-
-    Image(int width, int height)
-        : data(height, std::vector<Color>(width)), w_(width), h_(height) {}
-
-    int width() const { return data.empty() ? 0 : data[0].size(); }
-    int height() const { return data.size(); }
-
-    Color& at(int x, int y) { return data[y][x]; }
-    const Color& at(int x, int y) const { return data[y][x]; }
-
-    Image Resize(int w, int h) const {
-        Image trimmed(w, h);
-        for (int y = 0; y < h; ++y)
-            for (int x = 0; x < w; ++x)
-                if (x < w_ && y < h_)
-                    trimmed.at(x, y) = this->at(x, y);
-                else
-                    trimmed.at(x, y) = {0, 0, 0}; // Fill with black if out of bounds
-        return trimmed;
-    }
-};
-
-bool IsPowerOfTwo(int x) {
-    return x > 0 && (x & (x - 1)) == 0;
-}
-
-bool IsValidImageSize(const Image& img) {
-    return img.width() == img.height() && IsPowerOfTwo(img.width());
-}
-
-Image PadToSquare(const Image& input) {
-    int h = input.height();
-    int w = input.width();
-    int size = 1;
-    while (size < std::max(w, h)) size *= 2;
-
-    Image padded(size, size);
-    padded.w_ = w;
-    padded.h_ = h;
-
-    for (int y = 0; y < h; ++y)
-        for (int x = 0; x < w; ++x)
-            padded.at(x, y) = input.at(x, y);
-
-    return padded;
-}
-
 Image ReadImage(const std::string& filename) {
     int width, height, channels;
     unsigned char* data = stbi_load(filename.c_str(), &width, &height, &channels, 3);
@@ -100,97 +58,521 @@ void WriteImage(const std::string& filename, const Image& img) {
     stbi_write_png(filename.c_str(), width, height, 3, data.data(), width * 3);
 }
 
-bool isUniform(const std::vector<std::vector<Color>>& img, int x, int y, int size, int tolerance = 10) {
-    const Color& ref = img[y][x];
-    for (int j = y; j < y + size; ++j)
-        for (int i = x; i < x + size; ++i) {
-            const Color& c = img[j][i];
-            int dr = ref.r - c.r;
-            int dg = ref.g - c.g;
-            int db = ref.b - c.b;
-            if (dr * dr + dg * dg + db * db > tolerance * tolerance)
-                return false;
-        }
-    return true;
+// Kind of quadtree used to encode the images
+enum class Codec {
+    Flat,   // one colour per leaf
+    Planar, // flat or planar (gradient) colour model per leaf
+    Hybrid, // flat leaves, or DCT-coded blocks of at most 8x8 pixels
+    Bsp     // binary space partition, also saved next to the output as .bsp
+};
+
+const char* CodecName(Codec codec) {
+    static const char* names[] = {"flat", "planar", "hybrid", "bsp"};
+    return names[int(codec)];
 }
 
-QuadTree<Color>* Encode(const std::vector<std::vector<Color>>& img, int x, int y, int size) {
-    if (isUniform(img, x, y, size))
-        return new QuadLeaf<Color>(img[y][x]);
-
-    int half = size / 2;
-    return new QuadNode<Color>(
-        Encode(img, x, y, half),
-        Encode(img, x + half, y, half),
-        Encode(img, x + half, y + half, half),
-        Encode(img, x, y + half, half)
-    );
+// What encoding an image gave
+struct EncodeReport {
+    long leaves = 0;
+    long nodes = 0;     // inner nodes and leaves
+    std::string notes;  // optional, e.g. colour statistics
+};
+
+// Settings of a run, from the command line
+struct Options {
+    std::vector<Codec> codecs{Codec::Flat};
+    int tolerance = 10;
+    int blockSize = 8;      // largest transform-coded block of the hybrid codec
+    double psnr = 0;        // > 0: flat codec with the largest tolerance reaching this PSNR
+    bool shared = false;    // flat codec, one subtree dictionary for all the images
+    bool stats = false;     // colour statistics of the flat quadtrees
+    // Transforms applied to the flat quadtrees before decoding
+    int brightness = 0;     // added to each channel
+    int threshold = -1;     // black and white at this luminance; -1: none
+    // Rectangles painted over the flat quadtrees, each one a new version
+    // of a persistent tree sharing the untouched blocks with the previous
+    struct Fill {
+        int x, y, w, h;
+        Color color;
+    };
+    std::vector<Fill> fills;
+    bool bench = false;     // only time the codecs, with the hardware counters
+    bool succinct = false;  // save the flat quadtrees in succinct form (.qts) and decode that
+};
+
+// Colour as #rrggbb
+std::string HexColor(const Color& c) {
+    char s[8];
+    std::snprintf(s, sizeof(s), "#%02x%02x%02x", c.r, c.g, c.b);
+    return s;
 }
 
-void Decode(std::vector<std::vector<Color>>& img, QuadTree<Color>* node, int x, int y, int size) {
-    if (node->isLeaf()) {
-        Color c = node->value();
-        for (int j = y; j < y + size; ++j)
-            for (int i = x; i < x + size; ++i)
-                img[j][i] = c;
-    } else {
-        int half = size / 2;
-        Decode(img, node->son(NW), x, y, half);
-        Decode(img, node->son(NE), x + half, y, half);
-        Decode(img, node->son(SE), x + half, y + half, half);
-        Decode(img, node->son(SW), x, y + half, half);
+// Mean colour, standard deviation and dominant colours of the width x height
+// image encoded by qt, computed on its leaves
+std::string ColorStats(const QuadTree<Color>* qt, int size, int width, int height)
+{
+    ColorMoments m = Moments(qt, size, width, height);
+    char s[64];
+    std::snprintf(s, sizeof(s), ", sd %.1f %.1f %.1f", std::sqrt(m.variance[0]), std::sqrt(m.variance[1]),
+                  std::sqrt(m.variance[2]));
+    std::string stats = "mean " + HexColor(MeanColor(qt, size, width, height)) + s + ", dominant";
+    for (const auto& [color, area] : DominantColors(qt, size, width, height, 3)) {
+        std::snprintf(s, sizeof(s), " #%02x%02x%02x %.1f%%", color.r, color.g, color.b,
+                      100.0 * area / (double(width) * height));
+        stats += s;
     }
+    return stats;
 }
 
-void ProcessImg(const std::string& in, const std::string& out)
+// PSNR of b against a, over the 3 channels; both images have the same size
+double Psnr(const Image& a, const Image& b)
 {
+    double sse = 0;
+    for (int y = 0; y < a.height(); ++y)
+        for (int x = 0; x < a.width(); ++x) {
+            const Color& p = a.at(x, y);
+            const Color& q = b.at(x, y);
+            sse += double(p.r - q.r) * (p.r - q.r) + double(p.g - q.g) * (p.g - q.g) + double(p.b - q.b) * (p.b - q.b);
+        }
+    if (sse == 0)
+        return INFINITY;
+    return 10 * std::log10(3.0 * a.width() * a.height() * 255.0 * 255.0 / sse);
+}
+
+// Encode with a binary space partition, save it, and decode what was saved
+Image ProcessBsp(const Image& img, const std::string& out, int tolerance, EncodeReport& report)
+{
+    std::unique_ptr<BspNode> tree = EncodeBsp(img, tolerance);
+    report.leaves = tree->nLeaves();
+    report.nodes = 2 * report.leaves - 1;
+    std::string bspFilename = fs::path(out).replace_extension(".bsp").string();
+    {
+        std::ofstream os(bspFilename, std::ios::binary);
+        WriteBsp(os, tree.get(), img.width(), img.height());
+    }
+    std::ifstream is(bspFilename, std::ios::binary);
+    int w, h;
+    tree = ReadBsp(is, w, h);
+    Image decoded(w, h);
+    DecodeBsp(decoded.data, tree.get(), 0, 0, w, h);
+    return decoded;
+}
+
+// Encode the image in, decode it into out, and report on the tree
+EncodeReport ProcessImg(const std::string& in, const std::string& out, const Options& options = {},
+                        Codec codec = Codec::Flat)
+{
+    int tolerance = options.tolerance;
+    EncodeReport report;
     auto ext = fs::path(in).extension().string();
     if (ext == ".png" || ext == ".jpg" || ext == ".jpeg") {
-        std::cout << "Processing: " << in << std::endl;
-        Image img = ReadImage(in);
+        // One write per line, as images are processed concurrently
+        std::cout << ("Processing: " + in + "\n") << std::flush;
+        TraceSpan span("ProcessImg");
+        Image img = [&] {
+            TraceSpan read("ReadImage");
+            return ReadImage(in);
+        }();
+        if (codec == Codec::Bsp) {
+            WriteImage(out, ProcessBsp(img, out, tolerance, report));
+            return report;
+        }
+        // Kept to measure the PSNR actually reached
+        Image original = options.psnr > 0 ? img : Image();
         int originalW = img.width();
         int originalH = img.height();
         bool sizeChanged = false;
         if (!IsValidImageSize(img)) {
+            TraceSpan pad("PadToSquare");
             img = PadToSquare(img);
             sizeChanged = true;
         }
 
-        QuadTree<Color>* qt = Encode(img.data, 0, 0, img.height());
-
         Image decoded(img.height(), img.height());
-        Decode(decoded.data, qt, 0, 0, decoded.height());
+        if (codec == Codec::Planar) {
+            TraceSpan planar("Planar codec");
+            QuadTree<PlanarColor>* qt = EncodePlanar(img.data, 0, 0, img.height(), tolerance);
+            report = {qt->nLeaves(), qt->nTrees()};
+            DecodePlanar(decoded.data, qt, 0, 0, decoded.height());
+            delete qt;
+        } else if (codec == Codec::Hybrid) {
+            TraceSpan hybrid("Hybrid codec");
+            QuadTree<HybridColor>* qt = EncodeHybrid(img.data, 0, 0, img.height(), tolerance, options.blockSize);
+            report = {qt->nLeaves(), qt->nTrees()};
+            DecodeHybrid(decoded.data, qt, 0, 0, decoded.height());
+            delete qt;
+        } else {
+            QuadTree<Color>* qt;
+            if (options.psnr > 0) {
+                TraceSpan search("Tolerance search");
+                qt = EncodeForPsnr(img.data, originalW, originalH, options.psnr, tolerance);
+                report.notes = "tolerance " + std::to_string(tolerance);
+            } else {
+                qt = Encode(img.data, 0, 0, img.height(), tolerance);
+            }
+            if (options.brightness != 0 || options.threshold >= 0) {
+                TraceSpan transform("Transform");
+                report.notes += (report.notes.empty() ? "" : ", ") + std::to_string(qt->nLeaves())
+                              + " leaves before the transforms";
+                if (options.brightness != 0)
+                    qt = Brightness(qt, options.brightness);
+                if (options.threshold >= 0)
+                    qt = Threshold(qt, options.threshold);
+            }
+            if (!options.fills.empty()) {
+                TraceSpan edit("Fill");
+                QuadTreeHistory<Color> history(PersistentQuadTree<Color>::fromQuadTree(qt, img.height()));
+                for (const Options::Fill& f : options.fills)
+                    history.commit(history.current().fill(f.x, f.y, f.w, f.h, f.color));
+                delete qt;
+                qt = history.current().toQuadTree();
+                report.notes += (report.notes.empty() ? "" : ", ") + std::to_string(history.nVersions())
+                              + " versions in " + std::to_string(history.nTrees()) + " distinct nodes";
+            }
+            report.leaves = qt->nLeaves();
+            report.nodes = qt->nTrees();
+            if (options.stats)
+                report.notes += (report.notes.empty() ? "" : ", ") + ColorStats(qt, img.height(), originalW, originalH);
+            if (options.succinct) {
+                TraceSpan compact("Succinct codec");
+                std::string qtsFilename = fs::path(out).replace_extension(".qts").string();
+                {
+                    std::ofstream os(qtsFilename, std::ios::binary);
+                    SuccinctQuadTree(qt, img.height()).write(os);
+                }
+                std::ifstream is(qtsFilename, std::ios::binary);
+                SuccinctQuadTree compactTree = SuccinctQuadTree::read(is);
+                compactTree.decode(decoded.data);
+                report.notes += (report.notes.empty() ? "" : ", ") + std::string("succinct ")
+                              + std::to_string(fs::file_size(qtsFilename)) + " bytes";
+            } else {
+                ParallelDecode(decoded.data, qt, 0, 0, decoded.height());
+            }
+            delete qt;
+        }
 
         if (sizeChanged) {
+            TraceSpan resize("Resize");
             decoded = decoded.Resize(originalW, originalH);
         }
 
+        if (options.psnr > 0) {
+            char s[32];
+            std::snprintf(s, sizeof(s), ", %.2f dB", Psnr(original, decoded));
+            report.notes += s;
+        }
+
+        TraceSpan write("WriteImage");
         WriteImage(out, decoded);
+    }
+    return report;
+}
 
-        delete qt;
+// Encode and decode every image of the directory in with each codec of the
+// options, then print the size of their trees; with several codecs, the
+// decoded images are named after the codec. Return the number of images
+// that failed
+int ProcessDir(const std::string& in, const std::string& out, const Options& options)
+{
+    fs::create_directories(out);
+
+    TraceSpan span("ProcessDir");
+    std::vector<fs::path> files;
+    for (const auto& entry : fs::directory_iterator(in)) {
+        std::string ext = entry.path().extension().string();
+        if (entry.is_regular_file() && (ext == ".png" || ext == ".jpg" || ext == ".jpeg"))
+            files.push_back(entry.path());
     }
+
+    // One task per image on the shared pool; the decoders fork their own
+    // tasks on the same pool, so the workers stay busy across both levels.
+    // A bad file is reported and the others go on, rather than its
+    // exception ending the whole batch
+    std::atomic<int> nFailed{0};
+    parallelFor(files.size(), [&](size_t i) {
+        std::string report = files[i].filename().string() + ":";
+        try {
+            for (Codec codec : options.codecs) {
+                std::string suffix = options.codecs.size() > 1 ? std::string("_") + CodecName(codec) : "";
+                std::string outFilename = out + "/" + files[i].stem().string() + suffix + "_decoded.png";
+                EncodeReport r = ProcessImg(files[i].string(), outFilename, options, codec);
+                report += std::string(" ") + CodecName(codec) + " " + std::to_string(r.leaves) + " leaves ("
+                        + std::to_string(r.nodes) + " nodes)";
+                if (!r.notes.empty())
+                    report += ", " + r.notes;
+            }
+        } catch (const std::exception& e) {
+            std::cerr << ("Failed: " + files[i].string() + ": " + e.what() + "\n") << std::flush;
+            nFailed++;
+            return;
+        }
+        std::cout << (report + "\n") << std::flush;
+    });
+    return nFailed;
 }
 
-void ProcessDir(const std::string& in, const std::string& out)
+// Encode all the images of a directory into one shared subtree dictionary
+// (out/dictionary.qtd) plus one small reference file per image, then
+// decode them back from these files with a decoder cache shared by all
+void ProcessDirShared(const std::string& in, const std::string& out, int tolerance = 10)
 {
     fs::create_directories(out);
 
+    SubtreeDictionary dict;
+    std::vector<std::string> stems;
+    long totalTrees = 0;
     for (const auto& entry : fs::directory_iterator(in)) {
         if (!entry.is_regular_file()) continue;
-
-        std::string path = entry.path().string();
         std::string ext = entry.path().extension().string();
+        if (ext != ".png" && ext != ".jpg" && ext != ".jpeg") continue;
+
+        std::cout << "Encoding: " << entry.path().string() << std::endl;
+        Image img = ReadImage(entry.path().string());
+        SharedImageRef ref{img.width(), img.height(), 0, 0};
+        if (!IsValidImageSize(img))
+            img = PadToSquare(img);
+        ref.size = img.height();
+
+        QuadTree<Color>* qt = Encode(img.data, 0, 0, img.height(), tolerance);
+        totalTrees += qt->nTrees();
+        ref.root = dict.intern(qt);
+        delete qt;
+
+        std::string stem = entry.path().stem().string();
+        std::ofstream os(out + "/" + stem + ".qtr", std::ios::binary);
+        WriteImageRef(os, ref);
+        stems.push_back(stem);
+    }
+    {
+        std::ofstream os(out + "/dictionary.qtd", std::ios::binary);
+        dict.write(os);
+    }
+    std::cout << "Subtrees: " << totalTrees << ", distinct: " << dict.size() << std::endl;
+
+    std::ifstream dictFile(out + "/dictionary.qtd", std::ios::binary);
+    SubtreeDictionary loaded = SubtreeDictionary::read(dictFile);
+    DictionaryDecoder decoder(loaded);
+    for (const std::string& stem : stems) {
+        std::ifstream is(out + "/" + stem + ".qtr", std::ios::binary);
+        SharedImageRef ref = ReadImageRef(is, loaded);
+        Image decoded(ref.size, ref.size);
+        decoder.decode(decoded.data, ref.root, 0, 0, ref.size);
+        if (ref.width != ref.size || ref.height != ref.size)
+            decoded = decoded.Resize(ref.width, ref.height);
+        WriteImage(out + "/" + stem + "_decoded.png", decoded);
+    }
+}
+
+// Time of one codec step per pixel, then, when the counters are available,
+// instructions per cycle and cache, branch and dTLB misses per pixel. The
+// counters only see the calling thread, so a step forking tasks on the
+// pool (onPool) shows "pool" instead, unless the pool has a single thread
+// (the tasks then run on the caller).
+void BenchStep(const std::string& name, long pixels, bool onPool, const std::function<void()>& step)
+{
+    static PerfCounters counters;
+    counters.start();
+    auto start = std::chrono::steady_clock::now();
+    step();
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    counters.stop();
+
+    char line[128];
+    std::snprintf(line, sizeof(line), "  %-14s%10.2f ms%10.2f ns/px", name.c_str(), ms, ms * 1e6 / pixels);
+    std::cout << line;
+    using E = PerfCounters;
+    const E::Counts& c = counters.counts();
+    if (!counters.anyAvailable()) {
+        std::cout << "\n";
+        return;
+    }
+    if (onPool && WorkStealingPool::global().size() > 1) {
+        std::cout << std::setw(8) << "pool" << "\n";
+        return;
+    }
+    if (counters.available(E::Cycles) && counters.available(E::Instructions) && c[E::Cycles] > 0)
+        std::cout << std::setw(8) << std::fixed << std::setprecision(2) << c[E::Instructions] / c[E::Cycles];
+    else
+        std::cout << std::setw(8) << "-";
+    for (E::Event e : {E::CacheMisses, E::BranchMisses, E::DtlbMisses}) {
+        if (counters.available(e))
+            std::cout << std::setw(10) << std::fixed << std::setprecision(3) << c[e] / pixels;
+        else
+            std::cout << std::setw(10) << "-";
+    }
+    std::cout << "\n";
+}
 
-        std::string outFilename = out + "/" + entry.path().stem().string() + "_decoded.png";
+// Measure the encoder and decoders of each codec of the options on every
+// image of the directory in, one image at a time; nothing is written
+void BenchDir(const std::string& in, const Options& options)
+{
+    PerfCounters probe;
+    if (probe.anyAvailable())
+        std::cout << std::setw(53) << "IPC" << std::setw(10) << "cache" << std::setw(10) << "branch"
+                  << std::setw(10) << "dTLB" << "  (misses per pixel)\n";
+    else
+        std::cout << "Hardware counters unavailable (" << probe.error() << ")\n";
 
-        ProcessImg(path, outFilename);
+    for (const auto& entry : fs::directory_iterator(in)) {
+        std::string ext = entry.path().extension().string();
+        if (!entry.is_regular_file() || (ext != ".png" && ext != ".jpg" && ext != ".jpeg"))
+            continue;
+        Image original = ReadImage(entry.path().string());
+        Image img = IsValidImageSize(original) ? original : PadToSquare(original);
+        int n = img.height();
+        long pixels = long(n) * n;
+        std::cout << entry.path().filename().string() << " (" << original.width() << "x" << original.height()
+                  << ", encoded as " << n << "x" << n << ")\n";
+        int tolerance = options.tolerance;
+        Image decoded(n, n);
+        for (Codec codec : options.codecs) {
+            std::string name = CodecName(codec);
+            if (codec == Codec::Flat) {
+                QuadTree<Color>* qt = nullptr;
+                BenchStep(name + " encode", pixels, false, [&] { qt = Encode(img.data, 0, 0, n, tolerance); });
+                BenchStep(name + " decode", pixels, false, [&] { Decode(decoded.data, qt, 0, 0, n); });
+                BenchStep(name + " pdecode", pixels, true, [&] { ParallelDecode(decoded.data, qt, 0, 0, n); });
+                delete qt;
+            } else if (codec == Codec::Planar) {
+                QuadTree<PlanarColor>* qt = nullptr;
+                BenchStep(name + " encode", pixels, false, [&] { qt = EncodePlanar(img.data, 0, 0, n, tolerance); });
+                BenchStep(name + " decode", pixels, false, [&] { DecodePlanar(decoded.data, qt, 0, 0, n); });
+                delete qt;
+            } else if (codec == Codec::Hybrid) {
+                QuadTree<HybridColor>* qt = nullptr;
+                BenchStep(name + " encode", pixels, false, [&] { qt = EncodeHybrid(img.data, 0, 0, n, tolerance, options.blockSize); });
+                BenchStep(name + " decode", pixels, false, [&] { DecodeHybrid(decoded.data, qt, 0, 0, n); });
+                delete qt;
+            } else {
+                // Not padded: the BSP cuts any rectangle
+                long area = long(original.width()) * original.height();
+                Image bspDecoded(original.width(), original.height());
+                std::unique_ptr<BspNode> tree;
+                BenchStep(name + " encode", area, false, [&] { tree = EncodeBsp(original, tolerance); });
+                BenchStep(name + " decode", area, false, [&] {
+                    DecodeBsp(bspDecoded.data, tree.get(), 0, 0, original.width(), original.height());
+                });
+            }
+        }
     }
 }
 
-int main() {
-    ProcessDir("Images", "out");
+const char* usage =
+    "Usage: img [options] [input directory [output directory]]\n"
+    "Encode and decode every image of the input directory (Images by default)\n"
+    "into the output directory (out by default)\n"
+    "  --codec flat|planar|hybrid|bsp|all  kind of tree (flat by default)\n"
+    "  --tolerance t                       largest colour distance in a leaf (10 by default, 0: lossless)\n"
+    "  --block n                           largest DCT-coded block of the hybrid codec (power of two <= 32, 8 by default)\n"
+    "  --psnr db                           instead, the largest tolerance reaching this PSNR (flat codec)\n"
+    "  --brightness d                      add d to each channel of the leaves before decoding (flat codec)\n"
+    "  --threshold l                       then make the leaves black or white at luminance l (flat codec)\n"
+    "  --fill x,y,w,h,#rrggbb              then paint this rectangle, as a new version of the tree (flat codec)\n"
+    "  --stats                             print colour statistics computed on the tree (flat codec)\n"
+    "  --succinct                          save the trees in succinct form (.qts) and decode them from it (flat codec)\n"
+    "  --shared                            store all the images in one subtree dictionary (flat codec)\n"
+    "  --bench                             time the encoders and decoders instead, with the hardware counters\n"
+    "With TRACE_FILE set, a Chrome trace of the run is written to that file\n";
+
+// Throw runtime_error on a bad command line
+Options ParseOptions(int argc, char** argv, std::vector<std::string>& dirs)
+{
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc) throw std::runtime_error("Missing value after " + arg);
+            return argv[++i];
+        };
+        if (arg == "--codec") {
+            std::string name = value();
+            options.codecs.clear();
+            for (Codec codec : {Codec::Flat, Codec::Planar, Codec::Hybrid, Codec::Bsp})
+                if (name == CodecName(codec) || name == "all")
+                    options.codecs.push_back(codec);
+            if (options.codecs.empty()) throw std::runtime_error("Unknown codec " + name);
+        } else if (arg == "--tolerance") {
+            options.tolerance = std::stoi(value());
+            if (options.tolerance < 0) throw std::runtime_error("Negative tolerance");
+        } else if (arg == "--block") {
+            options.blockSize = std::stoi(value());
+            if (!IsPowerOfTwo(options.blockSize) || options.blockSize > maxHybridBlockSize)
+                throw std::runtime_error("The block size must be a power of two up to "
+                                         + std::to_string(maxHybridBlockSize));
+        } else if (arg == "--psnr") {
+            options.psnr = std::stod(value());
+            if (options.psnr <= 0) throw std::runtime_error("The PSNR must be positive");
+        } else if (arg == "--brightness") {
+            options.brightness = std::stoi(value());
+        } else if (arg == "--threshold") {
+            options.threshold = std::stoi(value());
+            if (options.threshold < 0 || options.threshold > 255) throw std::runtime_error("Threshold out of [0, 255]");
+        } else if (arg == "--fill") {
+            std::string fill = value();
+            Options::Fill f;
+            unsigned rgb;
+            char end;
+            if (std::sscanf(fill.c_str(), "%d,%d,%d,%d,#%6x%c", &f.x, &f.y, &f.w, &f.h, &rgb, &end) != 5
+                || f.x < 0 || f.y < 0 || f.w < 0 || f.h < 0)
+                throw std::runtime_error("Bad rectangle " + fill);
+            f.color = UnpackColor(rgb);
+            options.fills.push_back(f);
+        } else if (arg == "--bench") {
+            options.bench = true;
+        } else if (arg == "--succinct") {
+            options.succinct = true;
+        } else if (arg == "--stats") {
+            options.stats = true;
+        } else if (arg == "--shared") {
+            options.shared = true;
+        } else if (arg.rfind("--", 0) == 0) {
+            throw std::runtime_error("Unknown option " + arg);
+        } else {
+            dirs.push_back(arg);
+        }
+    }
+    if (dirs.size() > 2) throw std::runtime_error("Too many directories");
+    if (options.shared && (options.codecs.size() != 1 || options.codecs[0] != Codec::Flat))
+        throw std::runtime_error("--shared only supports the flat codec");
+    return options;
+}
+
+int main(int argc, char** argv) {
+    std::vector<std::string> dirs;
+    Options options;
+    try {
+        options = ParseOptions(argc, argv, dirs);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n" << usage;
+        return 2;
+    }
+
+    const char* traceFile = std::getenv("TRACE_FILE");
+    if (traceFile) {
+        Trace::setThreadName("main");
+        Trace::start();
+    }
+
+    std::string in = dirs.size() > 0 ? dirs[0] : "Images";
+    std::string out = dirs.size() > 1 ? dirs[1] : "out";
+    int nFailed = 0;
+    try {
+        if (options.bench)
+            BenchDir(in, options);
+        else if (options.shared)
+            ProcessDirShared(in, out, options.tolerance);
+        else
+            nFailed = ProcessDir(in, out, options);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        nFailed = 1;
+    }
+
+    if (traceFile && !Trace::write(traceFile))
+        std::cerr << "Cannot write " << traceFile << std::endl;
 
     //ProcessImg("../../img/Images/chat.png", "test/chat_decoded.png");
 
-    return 0;
-}
\ No newline at end of file
+    return nFailed > 0 ? 1 : 0;
+}
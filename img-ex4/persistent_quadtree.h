@@ -0,0 +1,187 @@
+/***************************************************************************
+ * Persistent (immutable) quadtree with structural sharing
+ *
+ * Nodes are never modified: an edit copies the path from the root down to
+ * the edited blocks and shares every other subtree with the previous
+ * version.  Nodes are reference counted (std::shared_ptr), so a subtree
+ * is freed when the last version using it goes away; there is no
+ * recursive delete and no need for protect_leaves_from_destruction.
+ * Keeping many versions (e.g. an undo history) thus costs little more
+ * memory than the differences between them.
+ ***************************************************************************/
+
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <unordered_set>
+#include <vector>
+#include "quadtree.h"
+
+template <typename T>
+class PersistentQuadTree {
+    struct Node {
+        bool leaf;
+        T val;                                      // leaf only
+        std::shared_ptr<const Node> sons[nQuadDir]; // node only
+
+        explicit Node(const T& v) : leaf(true), val(v) {}
+        Node(std::shared_ptr<const Node> s0, std::shared_ptr<const Node> s1,
+             std::shared_ptr<const Node> s2, std::shared_ptr<const Node> s3)
+            : leaf(false), val(), sons{std::move(s0), std::move(s1), std::move(s2), std::move(s3)} {}
+    };
+    using Ptr = std::shared_ptr<const Node>;
+
+    Ptr root;
+    int size_;
+
+    PersistentQuadTree(Ptr root, int size) : root(std::move(root)), size_(size) {}
+
+    // New node, or a single leaf if the 4 sons are leaves with the same value
+    static Ptr makeNode(Ptr s0, Ptr s1, Ptr s2, Ptr s3)
+    {
+        if (s0->leaf && s1->leaf && s2->leaf && s3->leaf
+            && s0->val == s1->val && s0->val == s2->val && s0->val == s3->val)
+            return s0;
+        return std::make_shared<const Node>(std::move(s0), std::move(s1), std::move(s2), std::move(s3));
+    }
+
+    static Ptr fromQuadTree_(const QuadTree<T>* qt)
+    {
+        if (qt->isLeaf())
+            return std::make_shared<const Node>(qt->value());
+        return makeNode(fromQuadTree_(qt->son(NW)), fromQuadTree_(qt->son(NE)),
+                        fromQuadTree_(qt->son(SE)), fromQuadTree_(qt->son(SW)));
+    }
+
+    static QuadTree<T>* toQuadTree_(const Node* node)
+    {
+        if (node->leaf)
+            return new QuadLeaf<T>(node->val);
+        return new QuadNode<T>(toQuadTree_(node->sons[NW].get()), toQuadTree_(node->sons[NE].get()),
+                               toQuadTree_(node->sons[SE].get()), toQuadTree_(node->sons[SW].get()));
+    }
+
+    // Copy of node where the rectangle [rx, rx+rw) x [ry, ry+rh) is set to v,
+    // the node covering the size x size block at (x, y)
+    static Ptr fill_(const Ptr& node, int x, int y, int size, int rx, int ry, int rw, int rh, const T& v)
+    {
+        if (rx >= x + size || ry >= y + size || rx + rw <= x || ry + rh <= y)
+            return node;                                    // untouched: shared
+        if (node->leaf && node->val == v)
+            return node;                                    // unchanged: still shared
+        if (rx <= x && ry <= y && rx + rw >= x + size && ry + rh >= y + size)
+            return std::make_shared<const Node>(v);         // fully covered
+        int half = size / 2;
+        Ptr sons[nQuadDir];
+        for (int d = 0; d < nQuadDir; d++)
+            sons[d] = node->leaf ? node : node->sons[d];    // a leaf is split into 4 copies of itself
+        Ptr filled[nQuadDir] = {fill_(sons[NW], x, y, half, rx, ry, rw, rh, v),
+                                fill_(sons[NE], x + half, y, half, rx, ry, rw, rh, v),
+                                fill_(sons[SE], x + half, y + half, half, rx, ry, rw, rh, v),
+                                fill_(sons[SW], x, y + half, half, rx, ry, rw, rh, v)};
+        if (!node->leaf && std::equal(filled, filled + nQuadDir, node->sons))
+            return node;                                    // no son changed
+        return makeNode(filled[NW], filled[NE], filled[SE], filled[SW]);
+    }
+
+    static void collect(const Node* node, std::unordered_set<const Node*>& seen)
+    {
+        if (!seen.insert(node).second || node->leaf)
+            return;
+        for (int d = 0; d < nQuadDir; d++)
+            collect(node->sons[d].get(), seen);
+    }
+
+public:
+    // A size x size image of uniform value (size must be a power of two)
+    PersistentQuadTree(int size, const T& background)
+        : root(std::make_shared<const Node>(background)), size_(size) {}
+
+    // Persistent copy of a quadtree covering a size x size image
+    static PersistentQuadTree fromQuadTree(const QuadTree<T>* qt, int size)
+    {
+        return PersistentQuadTree(fromQuadTree_(qt), size);
+    }
+
+    // Standalone (mutable) copy of this version; the caller deletes it
+    QuadTree<T>* toQuadTree() const { return toQuadTree_(root.get()); }
+
+    int size() const { return size_; }
+
+    // Value at pixel (x, y)
+    T at(int x, int y) const
+    {
+        if (x < 0 || y < 0 || x >= size_ || y >= size_)
+            throw std::out_of_range("Pixel out of the quadtree");
+        const Node* node = root.get();
+        int half = size_ / 2;
+        while (!node->leaf) {
+            int d = (y < half) ? (x < half ? NW : NE) : (x < half ? SW : SE);
+            if (x >= half) x -= half;
+            if (y >= half) y -= half;
+            node = node->sons[d].get();
+            half /= 2;
+        }
+        return node->val;
+    }
+
+    // New version with the rectangle of w x h pixels at (x, y) set to v
+    PersistentQuadTree fill(int x, int y, int w, int h, const T& v) const
+    {
+        return PersistentQuadTree(fill_(root, 0, 0, size_, x, y, w, h, v), size_);
+    }
+
+    // New version with pixel (x, y) set to v
+    PersistentQuadTree set(int x, int y, const T& v) const { return fill(x, y, 1, 1, v); }
+
+    // Tell if both versions are the very same tree (O(1))
+    bool sameAs(const PersistentQuadTree& other) const { return root == other.root; }
+
+    // Number of distinct nodes and leaves in this version
+    size_t nTrees() const { return distinctTrees({*this}); }
+
+    // Number of distinct nodes and leaves used by all the versions together
+    static size_t distinctTrees(const std::vector<PersistentQuadTree>& versions)
+    {
+        std::unordered_set<const Node*> seen;
+        for (const PersistentQuadTree& v : versions)
+            collect(v.root.get(), seen);
+        return seen.size();
+    }
+};
+
+/*--------------------------------------------------------------------------*
+ * Linear undo/redo history of persistent quadtree versions
+ *--------------------------------------------------------------------------*/
+template <typename T>
+class QuadTreeHistory {
+public:
+    explicit QuadTreeHistory(const PersistentQuadTree<T>& initial) : versions{initial} {}
+
+    const PersistentQuadTree<T>& current() const { return versions[pos]; }
+
+    // Make next the current version, dropping the versions that were undone
+    void commit(const PersistentQuadTree<T>& next)
+    {
+        versions.erase(versions.begin() + pos + 1, versions.end());
+        versions.push_back(next);
+        pos++;
+    }
+
+    bool canUndo() const { return pos > 0; }
+    bool canRedo() const { return pos + 1 < versions.size(); }
+
+    void undo() { if (canUndo()) pos--; }
+    void redo() { if (canRedo()) pos++; }
+
+    size_t nVersions() const { return versions.size(); }
+
+    // Distinct nodes and leaves kept alive by the whole history
+    size_t nTrees() const { return PersistentQuadTree<T>::distinctTrees(versions); }
+
+private:
+    std::vector<PersistentQuadTree<T>> versions;
+    size_t pos = 0;
+};
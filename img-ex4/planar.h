@@ -0,0 +1,178 @@
+/***************************************************************************
+ * Quadtree whose leaves hold a planar colour model instead of a flat colour
+ *
+ * A leaf covering a size x size block stores, per channel, the value at the
+ * block centre and the slopes along x and y.  The planes are fitted by least
+ * squares from summed-area tables, so fitting any block costs O(1).
+ ***************************************************************************/
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include "image.h"
+#include "codec.h"
+#include "quadtree.h"
+
+// Blocks smaller than this are only encoded as flat leaves
+const int minPlanarSize = 4;
+
+struct PlanarColor {
+    float mean[3];   // value at the centre of the block
+    float dx[3];     // slope along x, per pixel
+    float dy[3];     // slope along y, per pixel
+
+    bool isFlat() const {
+        return dx[0] == 0 && dx[1] == 0 && dx[2] == 0 && dy[0] == 0 && dy[1] == 0 && dy[2] == 0;
+    }
+
+    // Colour at offset (u, v) from the centre of the block
+    Color at(float u, float v) const {
+        int c[3];
+        for (int k = 0; k < 3; ++k)
+            c[k] = std::clamp(static_cast<int>(std::lround(mean[k] + dx[k] * u + dy[k] * v)), 0, 255);
+        return {c[0], c[1], c[2]};
+    }
+
+    static PlanarColor flat(const Color& c) {
+        return {{float(c.r), float(c.g), float(c.b)}, {0, 0, 0}, {0, 0, 0}};
+    }
+};
+
+/*--------------------------------------------------------------------------*
+ * Summed-area tables of I, x*I, y*I and I*I for the 3 channels (exact integers)
+ *--------------------------------------------------------------------------*/
+class ImageMoments {
+public:
+    explicit ImageMoments(const std::vector<std::vector<Color>>& img)
+        : n(img.size()), stride(n + 1), s(kMoments * 3, std::vector<int64_t>(size_t(stride) * stride, 0))
+    {
+        for (int y = 0; y < n; ++y)
+            for (int x = 0; x < n; ++x) {
+                const Color& c = img[y][x];
+                int ch[3] = {c.r, c.g, c.b};
+                for (int k = 0; k < 3; ++k) {
+                    int64_t v[kMoments] = {ch[k], int64_t(x) * ch[k], int64_t(y) * ch[k], int64_t(ch[k]) * ch[k]};
+                    for (int m = 0; m < kMoments; ++m) {
+                        std::vector<int64_t>& t = s[m * 3 + k];
+                        t[idx(x + 1, y + 1)] = v[m] + t[idx(x, y + 1)] + t[idx(x + 1, y)] - t[idx(x, y)];
+                    }
+                }
+            }
+    }
+
+    // Least-squares plane of the size x size block at (x, y)
+    // Also return the mean squared residual over the 3 channels
+    PlanarColor fit(int x, int y, int size, double& meanSquaredError) const
+    {
+        double area = double(size) * size;
+        double centreX = x + (size - 1) / 2.0;
+        double centreY = y + (size - 1) / 2.0;
+        // Sum of squared centred coordinates along one axis, over the block
+        double su2 = area * (double(size) * size - 1) / 12.0;
+        PlanarColor p;
+        double residual = 0;
+        for (int k = 0; k < 3; ++k) {
+            double sI = sum(kI, k, x, y, size);
+            double sxI = sum(kXI, k, x, y, size);
+            double syI = sum(kYI, k, x, y, size);
+            double sII = sum(kII, k, x, y, size);
+            double a = sI / area;
+            double bx = su2 > 0 ? (sxI - centreX * sI) / su2 : 0;
+            double by = su2 > 0 ? (syI - centreY * sI) / su2 : 0;
+            p.mean[k] = float(a);
+            p.dx[k] = float(bx);
+            p.dy[k] = float(by);
+            // Centred coordinates are orthogonal, so the residual has a closed form
+            residual += sII - area * a * a - su2 * (bx * bx + by * by);
+        }
+        meanSquaredError = std::max(0.0, residual / area);
+        return p;
+    }
+
+private:
+    static const int kMoments = 4;
+    static const int kI = 0, kXI = 1, kYI = 2, kII = 3;
+
+    int n;
+    int stride;
+    std::vector<std::vector<int64_t>> s;
+
+    size_t idx(int x, int y) const { return size_t(y) * stride + x; }
+
+    double sum(int m, int k, int x, int y, int size) const {
+        const std::vector<int64_t>& t = s[m * 3 + k];
+        return t[idx(x + size, y + size)] - t[idx(x, y + size)] - t[idx(x + size, y)] + t[idx(x, y)];
+    }
+};
+
+// Tell if the plane reproduces every pixel of the block within tolerance,
+// with the same rounding as DecodePlanar
+inline bool fitsPlane(const std::vector<std::vector<Color>>& img, const PlanarColor& p, int x, int y, int size, int tolerance) {
+    float centre = (size - 1) / 2.0f;
+    for (int j = 0; j < size; ++j)
+        for (int i = 0; i < size; ++i) {
+            Color pred = p.at(i - centre, j - centre);
+            const Color& c = img[y + j][x + i];
+            int dr = pred.r - c.r;
+            int dg = pred.g - c.g;
+            int db = pred.b - c.b;
+            if (dr * dr + dg * dg + db * db > tolerance * tolerance)
+                return false;
+        }
+    return true;
+}
+
+// Encode with a flat leaf when the block is uniform, else with a planar
+// leaf when the fitted plane is within tolerance everywhere, else split
+inline QuadTree<PlanarColor>* EncodePlanar(const std::vector<std::vector<Color>>& img, const ImageMoments& moments,
+                                           int x, int y, int size, int tolerance = 10) {
+    if (isUniform(img, x, y, size, tolerance))
+        return new QuadLeaf<PlanarColor>(PlanarColor::flat(img[y][x]));
+
+    if (size >= minPlanarSize) {
+        double mse;
+        PlanarColor p = moments.fit(x, y, size, mse);
+        // The maximum error is at least the RMS error (up to rounding):
+        // reject poor fits without scanning the pixels
+        if (mse <= double(tolerance) * tolerance && fitsPlane(img, p, x, y, size, tolerance))
+            return new QuadLeaf<PlanarColor>(p);
+    }
+
+    int half = size / 2;
+    return new QuadNode<PlanarColor>(
+        EncodePlanar(img, moments, x, y, half, tolerance),
+        EncodePlanar(img, moments, x + half, y, half, tolerance),
+        EncodePlanar(img, moments, x + half, y + half, half, tolerance),
+        EncodePlanar(img, moments, x, y + half, half, tolerance)
+    );
+}
+
+inline QuadTree<PlanarColor>* EncodePlanar(const std::vector<std::vector<Color>>& img, int x, int y, int size, int tolerance = 10) {
+    ImageMoments moments(img);
+    return EncodePlanar(img, moments, x, y, size, tolerance);
+}
+
+inline void DecodePlanar(std::vector<std::vector<Color>>& img, QuadTree<PlanarColor>* node, int x, int y, int size) {
+    if (node->isLeaf()) {
+        PlanarColor p = node->value();
+        if (p.isFlat()) {
+            Color c = p.at(0, 0);
+            for (int j = y; j < y + size; ++j)
+                std::fill(img[j].begin() + x, img[j].begin() + x + size, c);
+            return;
+        }
+        float centre = (size - 1) / 2.0f;
+        for (int j = 0; j < size; ++j)
+            for (int i = 0; i < size; ++i)
+                img[y + j][x + i] = p.at(i - centre, j - centre);
+    } else {
+        int half = size / 2;
+        DecodePlanar(img, node->son(NW), x, y, half);
+        DecodePlanar(img, node->son(NE), x + half, y, half);
+        DecodePlanar(img, node->son(SE), x + half, y + half, half);
+        DecodePlanar(img, node->son(SW), x, y + half, half);
+    }
+}
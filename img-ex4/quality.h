@@ -0,0 +1,201 @@
+/***************************************************************************
+ * Quality-targeted encoding: find the largest tolerance whose encoding
+ * meets a target PSNR or maximum error
+ *
+ * Encode makes a block a leaf when every pixel is within tolerance of the
+ * block's top-left pixel.  So if each block of the full pyramid knows its
+ * radius (largest squared distance to that pixel) and the sums needed for
+ * its squared error, the tree Encode would build for any tolerance, and its
+ * error, can be derived from this pyramid in O(leaves of that tree),
+ * without touching the pixels again.
+ *
+ * The error is measured on the width x height top-left part only (the
+ * original image, without the padding added by PadToSquare), and it does
+ * not always grow with the tolerance: a bigger leaf may happen to fit its
+ * pixels better than the 4 it replaces.  So every tolerance giving a
+ * distinct tree is tested, from the largest down.
+ ***************************************************************************/
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include "image.h"
+#include "quadtree.h"
+
+// Largest useful tolerance: the distance between black and white
+const int maxTolerance = 442;
+
+class ToleranceSearch {
+public:
+    // What encoding with a given tolerance would give
+    struct Result {
+        double sse = 0;      // sum of squared errors over the 3 channels
+        int maxError2 = 0;   // largest squared colour distance of a pixel
+        int nLeaves = 0;
+    };
+
+    // img must be a power-of-two square; the error is measured on its
+    // width x height top-left part (the whole square by default)
+    explicit ToleranceSearch(const std::vector<std::vector<Color>>& img, int width = -1, int height = -1)
+        : n(img.size()), width(width < 0 ? n : width), height(height < 0 ? n : height),
+          changes(maxTolerance + 1, false)
+    {
+        for (int size = 1; size <= n; size *= 2) {
+            int m = n / size;
+            std::vector<Block> level(size_t(m) * m);
+            for (int by = 0; by < m; ++by)
+                for (int bx = 0; bx < m; ++bx) {
+                    Block& b = level[size_t(by) * m + bx];
+                    int x = bx * size, y = by * size;
+                    b.ref = img[y][x];
+                    if (size == 1) {
+                        if (x < this->width && y < this->height) {
+                            b.sum[0] = b.ref.r; b.sum[1] = b.ref.g; b.sum[2] = b.ref.b;
+                            b.sumSq = int64_t(b.ref.r) * b.ref.r + int64_t(b.ref.g) * b.ref.g + int64_t(b.ref.b) * b.ref.b;
+                            b.count = 1;
+                        }
+                        continue;
+                    }
+                    // Sums come from the 4 sub-blocks, the radius from the pixels
+                    const std::vector<Block>& below = levels.back();
+                    int mb = m * 2;
+                    for (int d = 0; d < nQuadDir; d++) {
+                        const Block& s = below[size_t(2 * by + (d == SE || d == SW)) * mb + 2 * bx + (d == NE || d == SE)];
+                        for (int k = 0; k < 3; ++k) b.sum[k] += s.sum[k];
+                        b.sumSq += s.sumSq;
+                        b.count += s.count;
+                    }
+                    for (int j = y; j < y + size; ++j)
+                        for (int i = x; i < x + size; ++i) {
+                            const Color& c = img[j][i];
+                            int dr = b.ref.r - c.r, dg = b.ref.g - c.g, db = b.ref.b - c.b;
+                            int d2 = dr * dr + dg * dg + db * db;
+                            b.radius2 = std::max(b.radius2, d2);
+                            if (i < this->width && j < this->height)
+                                b.error2 = std::max(b.error2, d2);
+                        }
+                    if (b.radius2 > 0)
+                        changes[ceilSqrt(b.radius2)] = true;
+                }
+            levels.push_back(std::move(level));
+        }
+    }
+
+    // Number of pixels the error is measured on
+    long area() const { return long(width) * height; }
+
+    Result evaluate(int tolerance) const
+    {
+        Result r;
+        evaluate(int(levels.size()) - 1, 0, 0, tolerance * tolerance, r);
+        return r;
+    }
+
+    // Build the tree Encode would build with this tolerance
+    QuadTree<Color>* encode(int tolerance) const
+    {
+        return encode(int(levels.size()) - 1, 0, 0, tolerance * tolerance);
+    }
+
+    // Largest tolerance whose PSNR (over the 3 channels) is at least psnr
+    int toleranceForPsnr(double psnr) const
+    {
+        double maxSse = 3.0 * area() * 255.0 * 255.0 / std::pow(10.0, psnr / 10.0);
+        return largestTolerance([this, maxSse](int t) { return evaluate(t).sse <= maxSse; });
+    }
+
+    // Largest tolerance whose pixels are all within maxError of the original
+    int toleranceForMaxError(int maxError) const
+    {
+        return largestTolerance([this, maxError](int t) { return evaluate(t).maxError2 <= maxError * maxError; });
+    }
+
+private:
+    struct Block {
+        Color ref{0, 0, 0};      // top-left pixel
+        int64_t sum[3] = {0, 0, 0};
+        int64_t sumSq = 0;       // sum of r^2 + g^2 + b^2
+        long count = 0;          // pixels in the measured part
+        int radius2 = 0;         // largest squared distance of a pixel to ref
+        int error2 = 0;          // the same over the measured part
+    };
+
+    int n;
+    int width, height;
+    std::vector<std::vector<Block>> levels;   // levels[k] holds the blocks of size 2^k
+    // changes[t]: the tree of tolerance t differs from that of t - 1, as
+    // some block has (t - 1)^2 < radius2 <= t^2
+    std::vector<bool> changes;
+
+    static int ceilSqrt(int x) {
+        int t = int(std::sqrt(double(x)));
+        while (t * t < x) t++;
+        while (t > 0 && (t - 1) * (t - 1) >= x) t--;
+        return t;
+    }
+
+    const Block& block(int level, int bx, int by) const {
+        int m = n >> level;
+        return levels[level][size_t(by) * m + bx];
+    }
+
+    // Squared error of replacing every measured pixel of the block by its ref colour
+    static double sseToRef(const Block& b) {
+        double dot = double(b.ref.r) * b.sum[0] + double(b.ref.g) * b.sum[1] + double(b.ref.b) * b.sum[2];
+        double ref2 = double(b.ref.r) * b.ref.r + double(b.ref.g) * b.ref.g + double(b.ref.b) * b.ref.b;
+        return double(b.sumSq) - 2 * dot + b.count * ref2;
+    }
+
+    void evaluate(int level, int bx, int by, int tolerance2, Result& r) const
+    {
+        const Block& b = block(level, bx, by);
+        if (b.radius2 <= tolerance2) {
+            r.sse += sseToRef(b);
+            r.maxError2 = std::max(r.maxError2, b.error2);
+            r.nLeaves++;
+            return;
+        }
+        evaluate(level - 1, 2 * bx, 2 * by, tolerance2, r);
+        evaluate(level - 1, 2 * bx + 1, 2 * by, tolerance2, r);
+        evaluate(level - 1, 2 * bx + 1, 2 * by + 1, tolerance2, r);
+        evaluate(level - 1, 2 * bx, 2 * by + 1, tolerance2, r);
+    }
+
+    QuadTree<Color>* encode(int level, int bx, int by, int tolerance2) const
+    {
+        const Block& b = block(level, bx, by);
+        if (b.radius2 <= tolerance2)
+            return new QuadLeaf<Color>(b.ref);
+        return new QuadNode<Color>(
+            encode(level - 1, 2 * bx, 2 * by, tolerance2),
+            encode(level - 1, 2 * bx + 1, 2 * by, tolerance2),
+            encode(level - 1, 2 * bx + 1, 2 * by + 1, tolerance2),
+            encode(level - 1, 2 * bx, 2 * by + 1, tolerance2)
+        );
+    }
+
+    // Test the largest tolerance of each distinct tree, from the coarsest
+    // tree down; the big trees near tolerance 0 are only evaluated if no
+    // coarser one is good enough
+    template <typename Ok>
+    int largestTolerance(Ok ok) const
+    {
+        for (int t = maxTolerance; t > 0; --t)
+            if ((t == maxTolerance || changes[t + 1]) && ok(t))
+                return t;
+        return 0;   // tolerance 0 is lossless
+    }
+};
+
+// Encode with the largest tolerance reaching the given PSNR on the width x
+// height original image, img being it padded to a power-of-two square; the
+// chosen tolerance is stored in tolerance
+inline QuadTree<Color>* EncodeForPsnr(const std::vector<std::vector<Color>>& img, int width, int height, double psnr,
+                                      int& tolerance) {
+    ToleranceSearch search(img, width, height);
+    tolerance = search.toleranceForPsnr(psnr);
+    return search.encode(tolerance);
+}
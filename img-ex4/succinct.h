@@ -0,0 +1,272 @@
+/***************************************************************************
+ * Succinct quadtree: the structure in 1 bit per node, plus the leaf colours
+ *
+ * Nodes are numbered in level order (LOUDS).  Since every branching node
+ * has exactly 4 sons, the structure is fully described by one bit per node
+ * (1 = branching node, 0 = leaf):
+ *  - the sons of node i are 4 * rank1(i) + 1 ... 4 * rank1(i) + 4,
+ *  - the father of node i > 0 is select1((i - 1) / 4),
+ *  - the colour of leaf i is colours[rank0(i)],
+ * where rank1(i) is the number of 1s before position i and select1(k) the
+ * position of the k-th 1 (from 0).  Rank is O(1) with a directory of
+ * cumulative counts every 512 bits; select is a binary search on it.
+ ***************************************************************************/
+
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <deque>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "image.h"
+#include "binary_io.h"
+#include "quadtree.h"
+
+/*--------------------------------------------------------------------------*
+ * Bit vector with rank and select support
+ *--------------------------------------------------------------------------*/
+class RankSelectBits {
+public:
+    void push_back(bool bit)
+    {
+        if (n % 64 == 0) words.push_back(0);
+        if (bit) words.back() |= uint64_t(1) << (n % 64);
+        n++;
+    }
+
+    size_t size() const { return n; }
+
+    bool operator[](size_t i) const { return (words[i / 64] >> (i % 64)) & 1; }
+
+    // Build the rank directory, once all the bits are pushed
+    void index()
+    {
+        blocks.assign(words.size() / wordsPerBlock + 1, 0);
+        uint64_t count = 0;
+        for (size_t w = 0; w < words.size(); w++) {
+            if (w % wordsPerBlock == 0) blocks[w / wordsPerBlock] = count;
+            count += std::popcount(words[w]);
+        }
+        if (words.size() % wordsPerBlock == 0) blocks.back() = count;
+        ones = count;
+    }
+
+    // Number of 1s in [0, i)
+    size_t rank1(size_t i) const
+    {
+        size_t w = i / 64;
+        size_t r = blocks[w / wordsPerBlock];
+        for (size_t k = w - w % wordsPerBlock; k < w; k++)
+            r += std::popcount(words[k]);
+        if (i % 64)
+            r += std::popcount(words[w] & ((uint64_t(1) << (i % 64)) - 1));
+        return r;
+    }
+
+    // Number of 0s in [0, i)
+    size_t rank0(size_t i) const { return i - rank1(i); }
+
+    // Position of the k-th 1 (from 0)
+    size_t select1(size_t k) const
+    {
+        if (k >= ones) throw std::out_of_range("select1 beyond the last 1");
+        // Last block starting with at most k ones
+        size_t lo = 0, hi = blocks.size() - 1;
+        while (lo < hi) {
+            size_t mid = (lo + hi + 1) / 2;
+            if (blocks[mid] <= k) lo = mid; else hi = mid - 1;
+        }
+        size_t remaining = k - blocks[lo];
+        for (size_t w = lo * wordsPerBlock; w < words.size(); w++) {
+            size_t c = std::popcount(words[w]);
+            if (remaining < c) {
+                uint64_t word = words[w];
+                for (size_t j = 0; j < remaining; j++) word &= word - 1;   // drop the lowest 1s
+                return w * 64 + std::countr_zero(word);
+            }
+            remaining -= c;
+        }
+        throw std::logic_error("Inconsistent rank directory");
+    }
+
+    const std::vector<uint64_t>& data() const { return words; }
+
+    static RankSelectBits fromWords(std::vector<uint64_t> words, size_t n)
+    {
+        RankSelectBits b;
+        b.words = std::move(words);
+        b.n = n;
+        b.index();
+        return b;
+    }
+
+private:
+    static const size_t wordsPerBlock = 8;   // 512 bits
+
+    std::vector<uint64_t> words;
+    size_t n = 0;
+    std::vector<uint64_t> blocks;            // number of 1s before each block
+    size_t ones = 0;
+};
+
+/*--------------------------------------------------------------------------*
+ * Read-only quadtree of colours in succinct form
+ *--------------------------------------------------------------------------*/
+class SuccinctQuadTree {
+public:
+    using Node = size_t;                      // level-order number, root is 0
+
+    // Compact copy of a quadtree covering a size x size image
+    SuccinctQuadTree(const QuadTree<Color>* qt, int size) : size_(size)
+    {
+        std::deque<const QuadTree<Color>*> queue{qt};
+        while (!queue.empty()) {
+            const QuadTree<Color>* t = queue.front();
+            queue.pop_front();
+            if (t->isLeaf()) {
+                bits.push_back(false);
+                const Color& c = t->value();
+                colours.push_back(uint8_t(c.r));
+                colours.push_back(uint8_t(c.g));
+                colours.push_back(uint8_t(c.b));
+            } else {
+                bits.push_back(true);
+                for (int d = 0; d < nQuadDir; d++)
+                    queue.push_back(t->son(d));
+            }
+        }
+        bits.index();
+    }
+
+    int size() const { return size_; }
+    size_t nTrees() const { return bits.size(); }
+    size_t nLeaves() const { return colours.size() / 3; }
+
+    // Approximate memory footprint in bytes
+    size_t bytes() const { return bits.data().size() * 8 * 9 / 8 + colours.size(); }
+
+    static Node root() { return 0; }
+
+    bool isLeaf(Node i) const { return !bits[i]; }
+
+    Node son(Node i, int d) const
+    {
+        if (isLeaf(i)) throw std::domain_error("Not a QuadNode");
+        return 4 * bits.rank1(i) + 1 + d;
+    }
+
+    Node father(Node i) const
+    {
+        if (i == 0) throw std::domain_error("The root has no father");
+        return bits.select1((i - 1) / 4);
+    }
+
+    Color value(Node i) const
+    {
+        if (!isLeaf(i)) throw std::domain_error("Not a QuadLeaf");
+        size_t k = 3 * bits.rank0(i);
+        return {colours[k], colours[k + 1], colours[k + 2]};
+    }
+
+    // Colour of pixel (x, y)
+    Color at(int x, int y) const
+    {
+        if (x < 0 || y < 0 || x >= size_ || y >= size_)
+            throw std::out_of_range("Pixel out of the quadtree");
+        Node i = root();
+        int half = size_ / 2;
+        while (!isLeaf(i)) {
+            int d = (y < half) ? (x < half ? NW : NE) : (x < half ? SW : SE);
+            if (x >= half) x -= half;
+            if (y >= half) y -= half;
+            i = son(i, d);
+            half /= 2;
+        }
+        return value(i);
+    }
+
+    // Same as Decode, directly on the compact form
+    void decode(std::vector<std::vector<Color>>& img) const { decode(img, root(), 0, 0, size_); }
+
+    // Standalone pointer-based copy; the caller deletes it
+    QuadTree<Color>* toQuadTree(Node i = 0) const
+    {
+        if (isLeaf(i))
+            return new QuadLeaf<Color>(value(i));
+        return new QuadNode<Color>(toQuadTree(son(i, NW)), toQuadTree(son(i, NE)),
+                                   toQuadTree(son(i, SE)), toQuadTree(son(i, SW)));
+    }
+
+    // Format: "QTS1", size, number of nodes (uint32), the bit words (8 bytes
+    // little endian each), then r, g, b bytes for each leaf in level order
+    void write(std::ostream& os) const
+    {
+        os.write("QTS1", 4);
+        binary_io::putU32(os, size_);
+        binary_io::putU32(os, bits.size());
+        for (uint64_t w : bits.data()) {
+            binary_io::putU32(os, uint32_t(w));
+            binary_io::putU32(os, uint32_t(w >> 32));
+        }
+        os.write(reinterpret_cast<const char*>(colours.data()), colours.size());
+    }
+
+    // Throw runtime_error on malformed input
+    static SuccinctQuadTree read(std::istream& is)
+    {
+        char magic[4];
+        if (!is.read(magic, 4) || std::string(magic, 4) != "QTS1")
+            throw std::runtime_error("Not a succinct quadtree");
+        SuccinctQuadTree t;
+        t.size_ = int(binary_io::getU32(is));
+        if (!IsValidTreeSize(t.size_))
+            throw std::runtime_error("Bad size in succinct quadtree");
+        size_t n = binary_io::getU32(is);
+        // The full tree of a size x size image has (4 size^2 - 1) / 3 nodes
+        if (n > (4 * size_t(t.size_) * t.size_ - 1) / 3)
+            throw std::runtime_error("Too many nodes in succinct quadtree");
+        std::vector<uint64_t> words((n + 63) / 64);
+        for (uint64_t& w : words) {
+            w = binary_io::getU32(is);
+            w |= uint64_t(binary_io::getU32(is)) << 32;
+        }
+        t.bits = RankSelectBits::fromWords(std::move(words), n);
+        // A full 4-ary tree with k branching nodes has 4k + 1 nodes
+        size_t branching = t.bits.rank1(n);
+        if (n == 0 || n != 4 * branching + 1)
+            throw std::runtime_error("Bad structure in succinct quadtree");
+        t.colours.resize(3 * (n - branching));
+        if (!is.read(reinterpret_cast<char*>(t.colours.data()), t.colours.size()))
+            throw std::runtime_error("Truncated stream");
+        return t;
+    }
+
+private:
+    RankSelectBits bits;
+    std::vector<uint8_t> colours;             // r, g, b of the leaves, in level order
+    int size_ = 0;
+
+    SuccinctQuadTree() = default;
+
+    void decode(std::vector<std::vector<Color>>& img, Node i, int x, int y, int size) const
+    {
+        if (isLeaf(i)) {
+            Color c = value(i);
+            for (int j = y; j < y + size; ++j)
+                std::fill(img[j].begin() + x, img[j].begin() + x + size, c);
+            return;
+        }
+        // The 4 sons are consecutive: one rank for all of them
+        Node first = 4 * bits.rank1(i) + 1;
+        int half = size / 2;
+        decode(img, first + NW, x, y, half);
+        decode(img, first + NE, x + half, y, half);
+        decode(img, first + SE, x + half, y + half, half);
+        decode(img, first + SW, x, y + half, half);
+    }
+};
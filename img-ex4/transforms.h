@@ -0,0 +1,78 @@
+/***************************************************************************
+ * Colour transforms applied directly to quadtree leaves
+ *
+ * A transform maps a function over the leaf colours, then merges any node
+ * whose 4 sons became leaves of the same colour, so that the tree stays
+ * canonical.  No decode / re-encode is needed and the cost is O(leaves).
+ ***************************************************************************/
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <unordered_map>
+#include <cstdint>
+#include "image.h"
+#include "quadtree.h"
+
+// Apply f to the colour of every leaf, then merge equal siblings
+// Return the new root
+template <typename F>
+QuadTree<Color>* MapColors(QuadTree<Color>* qt, F&& f)
+{
+    if (qt->isLeaf()) {
+        qt->value() = f(qt->value());
+        return qt;
+    }
+    for (int d = 0; d < nQuadDir; d++)
+        qt->son(d) = MapColors(qt->son(d), f);
+    // Merge the node if its sons are now 4 leaves of the same colour
+    for (int d = 0; d < nQuadDir; d++)
+        if (!qt->son(d)->isLeaf() || !(qt->son(d)->value() == qt->son(0)->value()))
+            return qt;
+    QuadTree<Color>* leaf = new QuadLeaf<Color>(qt->son(0)->value());
+    delete qt;
+    return leaf;
+}
+
+// Only merge the nodes whose sons are 4 leaves of the same colour
+inline QuadTree<Color>* MergeLeaves(QuadTree<Color>* qt)
+{
+    return MapColors(qt, [](const Color& c) { return c; });
+}
+
+// Black and white: white where the luminance is at least level
+inline QuadTree<Color>* Threshold(QuadTree<Color>* qt, int level)
+{
+    return MapColors(qt, [level](const Color& c) {
+        int luma = (299 * c.r + 587 * c.g + 114 * c.b) / 1000;
+        return luma >= level ? Color{255, 255, 255} : Color{0, 0, 0};
+    });
+}
+
+// Look-up table applied to each channel
+inline QuadTree<Color>* ApplyLut(QuadTree<Color>* qt, const std::array<int, 256>& lut)
+{
+    return MapColors(qt, [&lut](const Color& c) {
+        return Color{lut[c.r], lut[c.g], lut[c.b]};
+    });
+}
+
+// Add delta to each channel, saturating to [0, 255]
+inline QuadTree<Color>* Brightness(QuadTree<Color>* qt, int delta)
+{
+    std::array<int, 256> lut;
+    for (int i = 0; i < 256; i++)
+        lut[i] = std::clamp(i + delta, 0, 255);
+    return ApplyLut(qt, lut);
+}
+
+// Replace each colour found in the palette (keyed by PackColor) by its
+// image, keep the others
+inline QuadTree<Color>* SwapPalette(QuadTree<Color>* qt, const std::unordered_map<uint32_t, Color>& palette)
+{
+    return MapColors(qt, [&palette](const Color& c) {
+        auto it = palette.find(PackColor(c));
+        return it == palette.end() ? c : it->second;
+    });
+}
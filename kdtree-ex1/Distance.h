@@ -0,0 +1,18 @@
+#pragma once
+#include <cstddef>
+
+// Squared distance of two float vectors of size n; 8 independent partial
+// sums so that the compiler can keep them in one vector register
+template <size_t n>
+float squaredDistance8(const float* a, const float* b) {
+    float acc[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    for (size_t i = 0; i < n / 8 * 8; i += 8)
+        for (size_t j = 0; j < 8; ++j) {
+            float d = a[i + j] - b[i + j];
+            acc[j] += d * d;
+        }
+    float sum = 0;
+    for (size_t i = n / 8 * 8; i < n; ++i) sum += (a[i] - b[i]) * (a[i] - b[i]);
+    for (float s : acc) sum += s;
+    return sum;
+}
@@ -0,0 +1,148 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <queue>
+#include <stdexcept>
+#include <vector>
+#include "KDTree.h"
+
+// KDTree whose points carry a payload and a category (0 .. 63), for queries
+// like "nearest point of category X". Each node keeps the set of categories
+// present in its subtree as a bitset, so that nearest neighbour searches
+// restricted to some categories skip the subtrees that hold none of them.
+// Any other condition on the payload goes in a predicate, checked point by
+// point (no pruning).
+template <typename T, size_t N, typename Payload>
+class FilteredKDTree {
+public:
+    struct Entry {
+        Point<T, N> point;
+        Payload payload;
+        unsigned category;
+    };
+
+    static const uint64_t allCategories = ~uint64_t(0);
+
+    static uint64_t categoryBit(unsigned category) { return uint64_t(1) << category; }
+
+private:
+    struct Node {
+        Entry entry;
+        uint64_t categories;                 // categories in this subtree
+        std::unique_ptr<Node> left;
+        std::unique_ptr<Node> right;
+        explicit Node(const Entry& e) : entry(e), categories(categoryBit(e.category)) {}
+    };
+
+    struct NodeTraits {
+        static const Point<T, N>& point(const Node& node) { return node.entry.point; }
+        static void added(Node& node, const Node& leaf) { node.categories |= leaf.categories; }
+        static void removed(Node& node) { updateCategories_(&node); }
+        static void replace(Node& node, const Node& by) { node.entry = by.entry; }
+    };
+    // Insert, remove and the nearest search order are those of KDTree
+    using Nodes = KDTreeNodes<T, N, Node, NodeTraits>;
+
+    std::unique_ptr<Node> root;
+    size_t count = 0;
+
+    static void updateCategories_(Node* node) {
+        node->categories = categoryBit(node->entry.category)
+                         | (node->left ? node->left->categories : 0)
+                         | (node->right ? node->right->categories : 0);
+    }
+
+    // The k best candidates so far, the farthest on top
+    struct Candidate {
+        T dist;
+        const Entry* entry;
+        bool operator<(const Candidate& c) const { return dist < c.dist; }
+    };
+    using Heap = std::priority_queue<Candidate>;
+
+    // Subtrees holding none of the categories are skipped
+    template <typename Pred>
+    void nearest_(const Point<T, N>& target, size_t k, uint64_t categories, Pred& pred, Heap& best) const {
+        auto visit = [&](const Node& node) {
+            const Entry& e = node.entry;
+            if (!(categoryBit(e.category) & categories) || !pred(e)) return;
+            T d = Point<T, N>::squaredDistance(target, e.point);
+            if (best.size() < k) {
+                best.push({d, &e});
+            } else if (d < best.top().dist) {
+                best.pop();
+                best.push({d, &e});
+            }
+        };
+        auto bound = [&] { return best.size() < k ? std::numeric_limits<T>::max() : best.top().dist; };
+        auto skip = [categories](const Node& node) { return !(node.categories & categories); };
+        Nodes::nearest(root.get(), target, 0, visit, bound, skip);
+    }
+
+public:
+    size_t size() const { return count; }
+
+    void insert(const Point<T, N>& p, const Payload& payload, unsigned category = 0)
+    {
+        if (category >= 64) throw std::out_of_range("Category beyond 63");
+        Nodes::insert(root, std::make_unique<Node>(Entry{p, payload, category}), 0);
+        count++;
+    }
+
+    // Remove one entry at p, whatever its payload
+    bool remove(const Point<T, N>& p)
+    {
+        if (!Nodes::remove(root, p, 0, [](const Node&) { return true; })) return false;
+        count--;
+        return true;
+    }
+
+    // Remove the entry at p with this payload (Payload needs ==), leaving
+    // the other entries at the same point
+    bool remove(const Point<T, N>& p, const Payload& payload)
+    {
+        if (!Nodes::remove(root, p, 0, [&](const Node& node) { return node.entry.payload == payload; }))
+            return false;
+        count--;
+        return true;
+    }
+
+    // Categories present in the tree
+    uint64_t categories() const { return root ? root->categories : 0; }
+
+    // The k nearest entries whose category is in the bitset categories and
+    // for which pred(entry) holds, nearest first
+    template <typename Pred>
+    std::vector<Entry> searchKNearest(const Point<T, N>& p, size_t k, uint64_t categories, Pred pred) const
+    {
+        Heap best;
+        if (k > 0) nearest_(p, k, categories, pred, best);
+        std::vector<Entry> out;
+        for (; !best.empty(); best.pop())
+            out.push_back(*best.top().entry);
+        std::reverse(out.begin(), out.end());
+        return out;
+    }
+
+    std::vector<Entry> searchKNearest(const Point<T, N>& p, size_t k, uint64_t categories = allCategories) const
+    {
+        return searchKNearest(p, k, categories, [](const Entry&) { return true; });
+    }
+
+    // Nearest entry matching both filters, if any
+    template <typename Pred>
+    std::optional<Entry> searchClosestNeighbor(const Point<T, N>& p, uint64_t categories, Pred pred) const
+    {
+        std::vector<Entry> best = searchKNearest(p, 1, categories, pred);
+        if (best.empty()) return std::nullopt;
+        return best[0];
+    }
+
+    std::optional<Entry> searchClosestNeighbor(const Point<T, N>& p, uint64_t categories = allCategories) const
+    {
+        return searchClosestNeighbor(p, categories, [](const Entry&) { return true; });
+    }
+};
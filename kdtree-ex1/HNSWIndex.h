@@ -0,0 +1,286 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <stdexcept>
+#include <vector>
+#include "Distance.h"
+#include "KDTree.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+// Hierarchical navigable small world graph (Malkov & Yashunin) for
+// approximate nearest neighbours in high dimensions. Every point gets a
+// random level; on each level up to its own it is linked to M neighbours
+// (2 M on level 0) chosen among efConstruction candidates. A query walks
+// greedily down the levels, then keeps the efSearch best candidates on
+// level 0. The capacity is fixed at construction, so that the vectors are
+// stored contiguously and never move; insert may run on several threads.
+template <typename T, size_t N>
+class HNSWIndex {
+    using Id = uint32_t;
+    using Candidate = std::pair<float, Id>;      // squared distance, point
+
+    size_t capacity;
+    size_t M, maxM0;
+    size_t efConstruction;
+    size_t efSearch = 32;
+    double levelFactor;                          // 1 / ln(M)
+
+    std::vector<float> data;                     // N floats per point
+    std::vector<T> coords;                       // the same in T, for Point
+    std::vector<int> levels;
+    std::vector<Id> links0;                      // per point: count, then maxM0 ids
+    std::vector<std::vector<std::vector<Id>>> upperLinks;   // [point][level - 1]
+    mutable std::vector<std::mutex> locks;       // per point, guard its links
+
+    std::atomic<size_t> count{0};
+    mutable std::mutex entryLock;                // guard entry and maxLevel
+    Id entry = 0;
+    int maxLevel = -1;
+    std::mt19937 gen{4321};
+    std::mutex genLock;
+
+    const float* vec_(Id i) const { return &data[size_t(i) * N]; }
+
+    float dist_(const float* q, Id i) const { return squaredDistance8<N>(q, vec_(i)); }
+
+    // Copy of the links of i on level lc
+    void neighbours_(Id i, int lc, std::vector<Id>& out) const {
+        std::lock_guard<std::mutex> guard(locks[i]);
+        if (lc == 0) {
+            const Id* l = &links0[size_t(i) * (maxM0 + 1)];
+            out.assign(l + 1, l + 1 + l[0]);
+        } else {
+            out = upperLinks[i][lc - 1];
+        }
+    }
+
+    void setNeighbours_(Id i, int lc, const std::vector<Id>& ids) {
+        if (lc == 0) {
+            Id* l = &links0[size_t(i) * (maxM0 + 1)];
+            l[0] = Id(ids.size());
+            std::copy(ids.begin(), ids.end(), l + 1);
+        } else {
+            upperLinks[i][lc - 1] = ids;
+        }
+    }
+
+    // Visited marks of the calling thread: visited[i] == epoch
+    struct Visited {
+        std::vector<uint32_t> marks;
+        uint32_t epoch = 0;
+    };
+
+    Visited& visited_() const {
+        thread_local Visited v;
+        if (v.marks.size() < capacity) v.marks.assign(capacity, 0);
+        if (++v.epoch == 0) {
+            std::fill(v.marks.begin(), v.marks.end(), 0);
+            v.epoch = 1;
+        }
+        return v;
+    }
+
+    // Best ef points of level lc reachable from the entry points, nearest first
+    std::vector<Candidate> searchLevel_(const float* q, const std::vector<Candidate>& entries, size_t ef, int lc) const {
+        Visited& visited = visited_();
+        std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>> toVisit;
+        std::priority_queue<Candidate> best;        // farthest on top
+        for (const Candidate& c : entries) {
+            visited.marks[c.second] = visited.epoch;
+            toVisit.push(c);
+            best.push(c);
+        }
+        while (best.size() > ef) best.pop();
+        std::vector<Id> neighbours;
+        while (!toVisit.empty()) {
+            Candidate c = toVisit.top();
+            if (c.first > best.top().first && best.size() >= ef) break;
+            toVisit.pop();
+            neighbours_(c.second, lc, neighbours);
+            for (Id e : neighbours) {
+                if (visited.marks[e] == visited.epoch) continue;
+                visited.marks[e] = visited.epoch;
+                float d = dist_(q, e);
+                if (best.size() < ef || d < best.top().first) {
+                    toVisit.push({d, e});
+                    best.push({d, e});
+                    if (best.size() > ef) best.pop();
+                }
+            }
+        }
+        std::vector<Candidate> out(best.size());
+        for (size_t i = out.size(); i-- > 0; best.pop()) out[i] = best.top();
+        return out;
+    }
+
+    // Nearest point of level lc from a single entry, by greedy moves
+    Candidate greedy_(const float* q, Candidate c, int lc) const {
+        std::vector<Id> neighbours;
+        for (bool moved = true; moved;) {
+            moved = false;
+            neighbours_(c.second, lc, neighbours);
+            for (Id e : neighbours) {
+                float d = dist_(q, e);
+                if (d < c.first) {
+                    c = {d, e};
+                    moved = true;
+                }
+            }
+        }
+        return c;
+    }
+
+    // Up to m of the candidates (nearest first): a candidate is kept only if
+    // it is closer to the base point than to every one already kept, which
+    // spreads the links in all directions
+    std::vector<Id> selectNeighbours_(const std::vector<Candidate>& candidates, size_t m) const {
+        std::vector<Id> kept;
+        for (const Candidate& c : candidates) {
+            if (kept.size() >= m) break;
+            bool diverse = true;
+            for (Id k : kept)
+                if (squaredDistance8<N>(vec_(c.second), vec_(k)) < c.first) {
+                    diverse = false;
+                    break;
+                }
+            if (diverse) kept.push_back(c.second);
+        }
+        return kept;
+    }
+
+    // Add link from i to e on level lc, pruning e's links when too many
+    void link_(Id e, Id i, int lc) {
+        std::lock_guard<std::mutex> guard(locks[e]);
+        size_t maxLinks = lc == 0 ? maxM0 : M;
+        std::vector<Id> ids;
+        if (lc == 0) {
+            const Id* l = &links0[size_t(e) * (maxM0 + 1)];
+            ids.assign(l + 1, l + 1 + l[0]);
+        } else {
+            ids = upperLinks[e][lc - 1];
+        }
+        ids.push_back(i);
+        if (ids.size() > maxLinks) {
+            std::vector<Candidate> candidates;
+            for (Id id : ids) candidates.push_back({dist_(vec_(e), id), id});
+            std::sort(candidates.begin(), candidates.end());
+            ids = selectNeighbours_(candidates, maxLinks);
+        }
+        setNeighbours_(e, lc, ids);
+    }
+
+    int randomLevel_() {
+        std::lock_guard<std::mutex> guard(genLock);
+        std::uniform_real_distribution<double> u(std::numeric_limits<double>::min(), 1.0);
+        return int(-std::log(u(gen)) * levelFactor);
+    }
+
+public:
+    HNSWIndex(size_t capacity, size_t M = 16, size_t efConstruction = 200)
+        : capacity(capacity), M(M), maxM0(2 * M), efConstruction(efConstruction),
+          levelFactor(1 / std::log(double(M))), data(capacity * N), coords(capacity * N),
+          levels(capacity), links0(capacity * (2 * M + 1)), upperLinks(capacity), locks(capacity)
+    {
+        if (M < 2) throw std::invalid_argument("HNSWIndex needs M >= 2");
+    }
+
+    size_t size() const { return count; }
+
+    // Candidates kept by queries (at least k)
+    void setEfSearch(size_t ef) { efSearch = std::max<size_t>(ef, 1); }
+    size_t getEfSearch() const { return efSearch; }
+
+    // Thread safe
+    void insert(const Point<T, N>& p)
+    {
+        size_t index = count++;
+        if (index >= capacity) {
+            count--;
+            throw std::length_error("HNSWIndex is full");
+        }
+        Id id = Id(index);
+        for (size_t a = 0; a < N; ++a) {
+            data[index * N + a] = float(p[a]);
+            coords[index * N + a] = p[a];
+        }
+        int level = randomLevel_();
+        levels[id] = level;
+        upperLinks[id].resize(level);
+
+        // The entry point is locked for the whole insertion of a new top level
+        std::unique_lock<std::mutex> top(entryLock);
+        if (maxLevel < 0) {
+            entry = id;
+            maxLevel = level;
+            return;
+        }
+        Id ep = entry;
+        int epLevel = maxLevel;
+        if (level <= epLevel) top.unlock();
+
+        const float* q = vec_(id);
+        Candidate c{dist_(q, ep), ep};
+        for (int lc = epLevel; lc > level; --lc) c = greedy_(q, c, lc);
+        std::vector<Candidate> entries{c};
+        for (int lc = std::min(level, epLevel); lc >= 0; --lc) {
+            std::vector<Candidate> candidates = searchLevel_(q, entries, efConstruction, lc);
+            std::vector<Id> chosen = selectNeighbours_(candidates, M);
+            {
+                std::lock_guard<std::mutex> guard(locks[id]);
+                setNeighbours_(id, lc, chosen);
+            }
+            for (Id e : chosen) link_(e, id, lc);
+            entries = std::move(candidates);
+        }
+        if (level > epLevel) {
+            entry = id;
+            maxLevel = level;
+        }
+    }
+
+    // Insert all the points, on every hardware thread
+    void insert(const std::vector<Point<T, N>>& points)
+    {
+        TraceSpan span("HNSWIndex insert", points.size());
+        parallelFor(points.size(), [&](size_t i) { insert(points[i]); }, 256);
+    }
+
+    // The (approximately) k nearest points, nearest first
+    std::vector<Point<T, N>> searchKNearest(const Point<T, N>& p, size_t k) const
+    {
+        Id ep;
+        int epLevel;
+        {
+            std::lock_guard<std::mutex> guard(entryLock);
+            ep = entry;
+            epLevel = maxLevel;
+        }
+        std::vector<Point<T, N>> out;
+        if (epLevel < 0 || k == 0) return out;
+        std::array<float, N> q;
+        for (size_t a = 0; a < N; ++a) q[a] = float(p[a]);
+        Candidate c{dist_(q.data(), ep), ep};
+        for (int lc = epLevel; lc > 0; --lc) c = greedy_(q.data(), c, lc);
+        std::vector<Candidate> best = searchLevel_(q.data(), {c}, std::max(efSearch, k), 0);
+        for (size_t i = 0; i < std::min(k, best.size()); ++i) {
+            std::array<T, N> a;
+            std::copy(&coords[size_t(best[i].second) * N], &coords[size_t(best[i].second) * N] + N, a.begin());
+            out.push_back(Point<T, N>(a));
+        }
+        return out;
+    }
+
+    Point<T, N> searchClosestNeighbor(const Point<T, N>& p) const
+    {
+        std::vector<Point<T, N>> best = searchKNearest(p, 1);
+        return best.empty() ? Point<T, N>({}) : best[0];
+    }
+};
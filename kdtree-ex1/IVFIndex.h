@@ -0,0 +1,169 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <queue>
+#include <random>
+#include <stdexcept>
+#include <vector>
+#include "Distance.h"
+#include "KDTree.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+// Approximate nearest neighbour index for high dimensions (inverted file):
+// a k-means coarse quantizer splits the points into nLists lists, each
+// stored as one contiguous float array; a query scans the nprobe lists
+// whose centroids are closest. nprobe = nLists gives exact answers.
+template <typename T, size_t N>
+class IVFIndex {
+    struct List {
+        std::vector<float> data;             // N floats per point
+        std::vector<Point<T, N>> points;
+    };
+
+    size_t nLists;
+    size_t nprobe = 1;
+    std::vector<float> centroids;            // N floats per list
+    std::vector<List> lists;
+    size_t count = 0;
+
+    static void toFloats_(const Point<T, N>& p, float* out) {
+        for (size_t i = 0; i < N; ++i) out[i] = float(p[i]);
+    }
+
+    size_t nearestCentroid_(const float* v) const {
+        size_t best = 0;
+        float bestDist = std::numeric_limits<float>::max();
+        for (size_t c = 0; c < nLists; ++c) {
+            float d = squaredDistance8<N>(v, &centroids[c * N]);
+            if (d < bestDist) {
+                bestDist = d;
+                best = c;
+            }
+        }
+        return best;
+    }
+
+    // Lloyd iterations on (a sample of) the points, seeded with random points
+    void train_(const std::vector<Point<T, N>>& points, size_t iterations) {
+        TraceSpan span("IVFIndex train");
+        const size_t maxSample = 64;         // training points per list
+        std::mt19937 gen(1234);
+        std::vector<size_t> sample(points.size());
+        for (size_t i = 0; i < sample.size(); ++i) sample[i] = i;
+        std::shuffle(sample.begin(), sample.end(), gen);
+        sample.resize(std::min(sample.size(), maxSample * nLists));
+
+        std::vector<float> data(sample.size() * N);
+        for (size_t i = 0; i < sample.size(); ++i) toFloats_(points[sample[i]], &data[i * N]);
+        centroids.assign(data.begin(), data.begin() + nLists * N);
+
+        std::vector<size_t> assign(sample.size());
+        std::vector<double> sums(nLists * N);
+        std::vector<size_t> sizes(nLists);
+        for (size_t it = 0; it < iterations; ++it) {
+            parallelFor(sample.size(), [&](size_t i) { assign[i] = nearestCentroid_(&data[i * N]); }, 256);
+            std::fill(sums.begin(), sums.end(), 0.0);
+            std::fill(sizes.begin(), sizes.end(), 0);
+            for (size_t i = 0; i < sample.size(); ++i) {
+                sizes[assign[i]]++;
+                for (size_t a = 0; a < N; ++a) sums[assign[i] * N + a] += data[i * N + a];
+            }
+            std::uniform_int_distribution<size_t> pick(0, sample.size() - 1);
+            for (size_t c = 0; c < nLists; ++c) {
+                // An empty list takes a random point
+                if (sizes[c] == 0) {
+                    size_t i = pick(gen);
+                    std::copy(&data[i * N], &data[i * N] + N, &centroids[c * N]);
+                    continue;
+                }
+                for (size_t a = 0; a < N; ++a) centroids[c * N + a] = float(sums[c * N + a] / sizes[c]);
+            }
+        }
+    }
+
+public:
+    // Train the quantizer on points, then add them all
+    IVFIndex(const std::vector<Point<T, N>>& points, size_t nLists, size_t iterations = 10)
+        : nLists(nLists), lists(nLists)
+    {
+        if (nLists == 0 || points.size() < nLists)
+            throw std::invalid_argument("IVFIndex needs at least nLists points");
+        TraceSpan span("IVFIndex build", points.size());
+        train_(points, iterations);
+        std::vector<size_t> assign(points.size());
+        parallelFor(points.size(), [&](size_t i) {
+            float v[N];
+            toFloats_(points[i], v);
+            assign[i] = nearestCentroid_(v);
+        }, 256);
+        for (size_t i = 0; i < points.size(); ++i) {
+            List& l = lists[assign[i]];
+            l.points.push_back(points[i]);
+            l.data.resize(l.data.size() + N);
+            toFloats_(points[i], &l.data[l.data.size() - N]);
+        }
+        count = points.size();
+    }
+
+    size_t size() const { return count; }
+    size_t listCount() const { return nLists; }
+
+    // Number of lists scanned by a query
+    void setNprobe(size_t n) { nprobe = std::clamp<size_t>(n, 1, nLists); }
+    size_t getNprobe() const { return nprobe; }
+
+    void insert(const Point<T, N>& p)
+    {
+        float v[N];
+        toFloats_(p, v);
+        List& l = lists[nearestCentroid_(v)];
+        l.points.push_back(p);
+        l.data.insert(l.data.end(), v, v + N);
+        count++;
+    }
+
+    bool search(const Point<T, N>& p) const
+    {
+        float v[N];
+        toFloats_(p, v);
+        const List& l = lists[nearestCentroid_(v)];
+        return std::find(l.points.begin(), l.points.end(), p) != l.points.end();
+    }
+
+    // The (approximately) k nearest points, nearest first
+    std::vector<Point<T, N>> searchKNearest(const Point<T, N>& p, size_t k) const
+    {
+        float v[N];
+        toFloats_(p, v);
+        std::vector<std::pair<float, size_t>> order(nLists);
+        for (size_t c = 0; c < nLists; ++c) order[c] = {squaredDistance8<N>(v, &centroids[c * N]), c};
+        std::partial_sort(order.begin(), order.begin() + nprobe, order.end());
+
+        // Farthest of the k best on top
+        std::priority_queue<std::pair<float, const Point<T, N>*>> best;
+        for (size_t probe = 0; probe < nprobe && k > 0; ++probe) {
+            const List& l = lists[order[probe].second];
+            for (size_t i = 0; i < l.points.size(); ++i) {
+                float d = squaredDistance8<N>(v, &l.data[i * N]);
+                if (best.size() < k) {
+                    best.push({d, &l.points[i]});
+                } else if (d < best.top().first) {
+                    best.pop();
+                    best.push({d, &l.points[i]});
+                }
+            }
+        }
+        std::vector<Point<T, N>> out;
+        for (; !best.empty(); best.pop()) out.push_back(*best.top().second);
+        std::reverse(out.begin(), out.end());
+        return out;
+    }
+
+    Point<T, N> searchClosestNeighbor(const Point<T, N>& p) const
+    {
+        std::vector<Point<T, N>> best = searchKNearest(p, 1);
+        return best.empty() ? Point<T, N>({}) : best[0];
+    }
+};
@@ -1,9 +1,15 @@
 ﻿#pragma once
+#include <algorithm>
 #include <array>
 #include <memory>
 #include <limits>
 #include <cmath>
 #include <iostream>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+#include "thread_pool.h"
+#include "trace.h"
 
 template <typename T, size_t N>
 class Point {
@@ -46,26 +52,163 @@ private:
     std::array<T, N> point;
 };
 
+// Kernels of KDTree::kernelDensity
+enum class Kernel { Gaussian, Epanechnikov };
+
+// Node orders of KDTree::compact
+enum class Layout { DepthFirst, VanEmdeBoas };
+
+// Node algorithms shared by KDTree and FilteredKDTree. A node has left and
+// right links (unique_ptr-like); a node at depth d splits on axis d % N,
+// with smaller coordinates on the left and larger or equal ones on the
+// right. Traits gives:
+//   static const Point<T, N>& point(const Node&)
+//   static void added(Node& node, const Node& leaf)    leaf was added below node
+//   static void removed(Node& node)                    a node below node was removed
+//   static void replace(Node& node, const Node& by)    node takes over the value of by
+template <typename T, size_t N, typename Node, typename Traits>
+struct KDTreeNodes {
+    // Add leaf below node (or as node if empty)
+    template <typename Link>
+    static void insert(Link& node, Link leaf, size_t depth) {
+        Link* at = &node;
+        const Point<T, N>& p = Traits::point(*leaf);
+        for (; *at; ++depth) {
+            Traits::added(**at, *leaf);
+            size_t axis = depth % N;
+            at = p[axis] < Traits::point(**at)[axis] ? &(*at)->left : &(*at)->right;
+        }
+        *at = std::move(leaf);
+    }
+
+    // Node of smallest coordinate on axis in the subtree, nullptr if empty
+    static const Node* findMin(const Node* node, size_t axis, size_t depth) {
+        if (!node) return nullptr;
+        if (depth % N == axis)
+            return node->left ? findMin(node->left.get(), axis, depth + 1) : node;
+        const Node* best = node;
+        for (const Node* son : {node->left.get(), node->right.get()}) {
+            const Node* m = findMin(son, axis, depth + 1);
+            if (m && Traits::point(*m)[axis] < Traits::point(*best)[axis]) best = m;
+        }
+        return best;
+    }
+
+    // Matches one given node (a named type, so that remove does not
+    // instantiate itself with a new lambda type at each level)
+    struct Is {
+        const Node* node;
+        bool operator()(const Node& n) const { return &n == node; }
+    };
+
+    // Remove the first node at p for which match(node) holds. Equal points
+    // all lie on the search path of p, on the right of each other. The
+    // removed node takes over the value of the smallest node of a subtree on
+    // its axis, then that very node is removed; a lone left subtree moves to
+    // the right, so that no subtree changes depth.
+    template <typename Link, typename Match>
+    static bool remove(Link& node, const Point<T, N>& p, size_t depth, const Match& match) {
+        if (!node) return false;
+        if (Traits::point(*node) == p && match(*node)) {
+            if (!node->left && !node->right) {
+                node.reset();
+                return true;
+            }
+            if (!node->right) node->right = std::move(node->left);
+            const Node* m = findMin(node->right.get(), depth % N, depth + 1);
+            Traits::replace(*node, *m);
+            remove(node->right, Traits::point(*node), depth + 1, Is{m});
+            Traits::removed(*node);
+            return true;
+        }
+        size_t axis = depth % N;
+        if (!remove(p[axis] < Traits::point(*node)[axis] ? node->left : node->right, p, depth + 1, match))
+            return false;
+        Traits::removed(*node);
+        return true;
+    }
+
+    // Nearest neighbour search order: visit(node) every node not pruned,
+    // the side of target first; the other side only while its splitting
+    // plane is closer than bound() (a squared distance). skip(node) prunes
+    // a whole subtree.
+    template <typename Visit, typename Bound, typename Skip>
+    static void nearest(const Node* node, const Point<T, N>& target, size_t depth, Visit& visit, Bound& bound,
+                        Skip& skip) {
+        if (!node || skip(*node)) return;
+        visit(*node);
+        size_t axis = depth % N;
+        const Point<T, N>& q = Traits::point(*node);
+        bool goLeft = target[axis] < q[axis];
+        nearest(goLeft ? node->left.get() : node->right.get(), target, depth + 1, visit, bound, skip);
+        T diff = target[axis] - q[axis];
+        if (diff * diff < bound())
+            nearest(goLeft ? node->right.get() : node->left.get(), target, depth + 1, visit, bound, skip);
+    }
+};
+
 template <typename T, size_t N>
 class KDTree {
+    struct Node;
+
+    // Nodes come from the heap, or from a block filled by compact(); a
+    // block is freed with its last node
+    struct Block {
+        Node* nodes;
+        size_t size;
+        size_t live;
+    };
+
+    struct NodeDeleter {
+        void operator()(Node* node) const {
+            Block* block = node->block;
+            if (!block) {
+                delete node;
+                return;
+            }
+            node->~Node();
+            if (--block->live == 0) {
+                std::allocator<Node>().deallocate(block->nodes, block->size);
+                delete block;
+            }
+        }
+    };
+    using Link = std::unique_ptr<Node, NodeDeleter>;
+
     struct Node {
         Point<T, N> point;
-        std::unique_ptr<Node> left;
-        std::unique_ptr<Node> right;
-        explicit Node(const Point<T, N>& p) : point(p) {}
+        Link left;
+        Link right;
+        T nnDist2 = 0;       // squared distance to the nearest other point
+        T maxNnDist2 = 0;    // largest nnDist2 of the subtree
+        size_t count = 1;    // points in the subtree
+        // Bounding box of the subtree; grown on insert, but not shrunk on
+        // remove (so only an upper bound of the box afterwards)
+        std::array<T, N> lo, hi;
+        Block* block = nullptr;
+        explicit Node(const Point<T, N>& p) : point(p) {
+            for (size_t i = 0; i < N; ++i) lo[i] = hi[i] = p[i];
+        }
     };
 
-    std::unique_ptr<Node> root;
+    Link root;
+    bool rnnReady = false;   // nnDist2 and maxNnDist2 up to date
+    size_t changes = 0;      // inserts and removes since the last compact
+    size_t compactEvery = 0; // compact after that many changes (0: never)
 
-    std::unique_ptr<Node> insert_(std::unique_ptr<Node> node, const Point<T, N>& p, size_t depth) {
-        if (!node) return std::make_unique<Node>(p);
-        size_t axis = depth % N;
-        if (p[axis] < node->point[axis])
-            node->left = insert_(std::move(node->left), p, depth + 1);
-        else
-            node->right = insert_(std::move(node->right), p, depth + 1);
-        return node;
-    }
+    struct NodeTraits {
+        static const Point<T, N>& point(const Node& node) { return node.point; }
+        static void added(Node& node, const Node& leaf) {
+            node.count++;
+            for (size_t i = 0; i < N; ++i) {
+                node.lo[i] = std::min(node.lo[i], leaf.point[i]);
+                node.hi[i] = std::max(node.hi[i], leaf.point[i]);
+            }
+        }
+        static void removed(Node& node) { node.count--; }
+        static void replace(Node& node, const Node& by) { node.point = by.point; }
+    };
+    using Nodes = KDTreeNodes<T, N, Node, NodeTraits>;
 
     bool search_(const Node* node, const Point<T, N>& p, size_t depth) const {
         if (!node) return false;
@@ -73,55 +216,409 @@ class KDTree {
         return search_((p[depth % N] < node->point[depth % N]) ? node->left.get() : node->right.get(), p, depth + 1);
     }
 
-    bool remove_(std::unique_ptr<Node>& node, const Point<T, N>& p, size_t depth) {
-        if (!node) return false;
-        if (node->point == p) {
-            if (node->right) {
-                node->point = findMin_(node->right.get(), depth % N, 0);
-                remove_(node->right, node->point, depth + 1);
-            } else {
-                node = std::move(node->left);
+    void nearestNeighbor_(const Node* node, const Point<T, N>& target, const Node*& best, T& bestDist, size_t depth) const {
+        auto visit = [&](const Node& n) {
+            T d = Point<T, N>::squaredDistance(target, n.point);
+            if (d < bestDist) {
+                bestDist = d;
+                best = &n;
             }
-            return true;
-        }
-        return remove_((p[depth % N] < node->point[depth % N]) ? node->left : node->right, p, depth + 1);
+        };
+        auto bound = [&] { return bestDist; };
+        auto skip = [](const Node&) { return false; };
+        Nodes::nearest(node, target, depth, visit, bound, skip);
+    }
+
+    void range_(const Node* node, const Point<T, N>& lo, const Point<T, N>& hi, size_t depth, std::vector<Point<T, N>>& out) const {
+        if (!node) return;
+        bool inside = true;
+        for (size_t i = 0; i < N; ++i)
+            inside = inside && lo[i] <= node->point[i] && node->point[i] <= hi[i];
+        if (inside) out.push_back(node->point);
+        size_t axis = depth % N;
+        if (lo[axis] < node->point[axis])
+            range_(node->left.get(), lo, hi, depth + 1, out);
+        if (node->point[axis] <= hi[axis])
+            range_(node->right.get(), lo, hi, depth + 1, out);
     }
 
-    Point<T, N> findMin_(const Node* node, size_t axis, size_t depth) const {
-        if (!node) return Point<T, N>({});
-        if (depth % N == axis) {
-            return node->left ? findMin_(node->left.get(), axis, depth + 1) : node->point;
+    // Nearest neighbour of target other than the node self
+    void nearestOther_(const Node* node, const Node* self, const Point<T, N>& target,
+                       const Node*& best, T& bestDist, size_t depth) const {
+        if (!node) return;
+        if (node != self) {
+            T d = Point<T, N>::squaredDistance(target, node->point);
+            if (d < bestDist) {
+                bestDist = d;
+                best = node;
+            }
         }
-        Point<T, N> leftMin = node->left ? findMin_(node->left.get(), axis, depth + 1) : node->point;
-        Point<T, N> rightMin = node->right ? findMin_(node->right.get(), axis, depth + 1) : node->point;
-        return (leftMin[axis] < rightMin[axis]) ? leftMin : rightMin;
+        size_t axis = depth % N;
+        bool goLeft = target[axis] < node->point[axis];
+        nearestOther_(goLeft ? node->left.get() : node->right.get(), self, target, best, bestDist, depth + 1);
+        T diff = target[axis] - node->point[axis];
+        if (diff * diff < bestDist)
+            nearestOther_(goLeft ? node->right.get() : node->left.get(), self, target, best, bestDist, depth + 1);
     }
 
-    void nearestNeighbor_(const Node* node, const Point<T, N>& target, const Node*& best, T& bestDist, size_t depth) const {
+    // Nodes in preorder: the subtree of a node follows it
+    template <typename NodePtr>
+    static void collectNodes_(NodePtr node, std::vector<NodePtr>& out) {
         if (!node) return;
+        out.push_back(node);
+        collectNodes_<NodePtr>(node->left.get(), out);
+        collectNodes_<NodePtr>(node->right.get(), out);
+    }
+
+    static T maxNnDist2_(Node* node) {
+        if (!node) return 0;
+        node->maxNnDist2 = std::max({node->nnDist2, maxNnDist2_(node->left.get()), maxNnDist2_(node->right.get())});
+        return node->maxNnDist2;
+    }
+
+    // Points p of the subtree, in the box [lo, hi], with |p - q| <= nnDist(p).
+    // A subtree is skipped when q is farther from its box than its maxNnDist.
+    void reverseNeighbors_(const Node* node, const Point<T, N>& q, std::array<T, N>& lo, std::array<T, N>& hi,
+                           size_t depth, std::vector<Point<T, N>>& out) const {
+        if (!node) return;
+        T boxDist2 = 0;
+        for (size_t i = 0; i < N; ++i) {
+            T diff = q[i] < lo[i] ? lo[i] - q[i] : (q[i] > hi[i] ? q[i] - hi[i] : 0);
+            boxDist2 += diff * diff;
+        }
+        if (boxDist2 > node->maxNnDist2) return;
+        if (node->point != q && Point<T, N>::squaredDistance(q, node->point) <= node->nnDist2)
+            out.push_back(node->point);
+        size_t axis = depth % N;
+        T saved = hi[axis];
+        hi[axis] = node->point[axis];
+        reverseNeighbors_(node->left.get(), q, lo, hi, depth + 1, out);
+        hi[axis] = saved;
+        saved = lo[axis];
+        lo[axis] = node->point[axis];
+        reverseNeighbors_(node->right.get(), q, lo, hi, depth + 1, out);
+        lo[axis] = saved;
+    }
+
+    // Flattened copy of the tree for Boruvka: nodes in preorder, the subtree
+    // of node i being i .. i + sizes[i] - 1, with its bounding box lo .. hi
+    struct Flat_ {
+        std::vector<const Node*> nodes;
+        std::vector<size_t> sizes;
+        std::vector<std::array<T, N>> lo, hi;
+    };
+
+    Flat_ flatten_() const {
+        Flat_ f;
+        collectNodes_<const Node*>(root.get(), f.nodes);
+        size_t n = f.nodes.size();
+        f.sizes.assign(n, 1);
+        f.lo.resize(n);
+        f.hi.resize(n);
+        for (size_t i = n; i-- > 0;) {
+            const Node* node = f.nodes[i];
+            for (size_t a = 0; a < N; ++a) f.lo[i][a] = f.hi[i][a] = node->point[a];
+            size_t son = i + 1;
+            for (const Node* s : {node->left.get(), node->right.get()}) {
+                if (!s) continue;
+                f.sizes[i] += f.sizes[son];
+                for (size_t a = 0; a < N; ++a) {
+                    f.lo[i][a] = std::min(f.lo[i][a], f.lo[son][a]);
+                    f.hi[i][a] = std::max(f.hi[i][a], f.hi[son][a]);
+                }
+                son += f.sizes[son];
+            }
+        }
+        return f;
+    }
+
+    static T boxDistance_(const Flat_& f, size_t i, const Point<T, N>& p) {
+        T sum = 0;
+        for (size_t a = 0; a < N; ++a) {
+            T diff = p[a] < f.lo[i][a] ? f.lo[i][a] - p[a] : (p[a] > f.hi[i][a] ? p[a] - f.hi[i][a] : 0);
+            sum += diff * diff;
+        }
+        return sum;
+    }
+
+    static const size_t none_ = size_t(-1);
+
+    // Nearest point to point q in another component, ties going to the
+    // smallest index. uniform[i] is the component of the whole subtree i,
+    // or none_, so that subtrees of q's own component are skipped at once.
+    static void nearestForeign_(const Flat_& f, size_t i, size_t q, const std::vector<size_t>& comp,
+                                const std::vector<size_t>& uniform, size_t& best, T& bestDist) {
+        if (uniform[i] == comp[q]) return;
+        const Point<T, N>& target = f.nodes[q]->point;
+        if (comp[i] != comp[q]) {
+            T d = Point<T, N>::squaredDistance(target, f.nodes[i]->point);
+            if (d < bestDist || (d == bestDist && i < best)) {
+                bestDist = d;
+                best = i;
+            }
+        }
+        // Visit the son whose box is closest first
+        size_t sons[2];
+        T dist[2];
+        size_t nSons = 0, son = i + 1;
+        for (const Node* s : {f.nodes[i]->left.get(), f.nodes[i]->right.get()}) {
+            if (!s) continue;
+            sons[nSons] = son;
+            dist[nSons++] = boxDistance_(f, son, target);
+            son += f.sizes[son];
+        }
+        if (nSons == 2 && dist[1] < dist[0]) {
+            std::swap(sons[0], sons[1]);
+            std::swap(dist[0], dist[1]);
+        }
+        for (size_t k = 0; k < nSons; ++k)
+            if (dist[k] <= bestDist)
+                nearestForeign_(f, sons[k], q, comp, uniform, best, bestDist);
+    }
+
+    static size_t findRoot_(std::vector<size_t>& parent, size_t i) {
+        while (parent[i] != i) i = parent[i] = parent[parent[i]];
+        return i;
+    }
+
+    // Largest squared distance from p to a point of the box lo .. hi
+    static T boxMaxDistance_(const std::array<T, N>& lo, const std::array<T, N>& hi, const Point<T, N>& p) {
+        T sum = 0;
+        for (size_t a = 0; a < N; ++a) {
+            T diff = std::max(p[a] - lo[a], hi[a] - p[a]);
+            sum += diff * diff;
+        }
+        return sum;
+    }
+
+    void furthestNeighbor_(const Node* node, const Point<T, N>& target, const Node*& best, T& bestDist) const {
         T d = Point<T, N>::squaredDistance(target, node->point);
-        if (d < bestDist) {
+        if (!best || d > bestDist) {
             bestDist = d;
             best = node;
         }
-        size_t axis = depth % N;
-        const Node* nextBranch = (target[axis] < node->point[axis]) ? node->left.get() : node->right.get();
-        const Node* otherBranch = (target[axis] < node->point[axis]) ? node->right.get() : node->left.get();
-        nearestNeighbor_(nextBranch, target, best, bestDist, depth + 1);
-        if ((target[axis] - node->point[axis]) * (target[axis] - node->point[axis]) < bestDist) {
-            nearestNeighbor_(otherBranch, target, best, bestDist, depth + 1);
+        // Visit the son whose box reaches farthest first
+        const Node* sons[2];
+        T dist[2];
+        size_t nSons = 0;
+        for (const Node* s : {node->left.get(), node->right.get()}) {
+            if (!s) continue;
+            sons[nSons] = s;
+            dist[nSons++] = boxMaxDistance_(s->lo, s->hi, target);
+        }
+        if (nSons == 2 && dist[1] > dist[0]) {
+            std::swap(sons[0], sons[1]);
+            std::swap(dist[0], dist[1]);
         }
+        for (size_t k = 0; k < nSons; ++k)
+            if (dist[k] > bestDist)
+                furthestNeighbor_(sons[k], target, best, bestDist);
+    }
+
+    // Farthest point sampling: lower minDist (squared distance to the
+    // nearest sample) in subtree i for the new sample s, and update maxMin
+    // (largest minDist of the subtree). A subtree whose box is no closer to
+    // s than its maxMin cannot change, so only the region around s is visited.
+    static void fpsUpdate_(const Flat_& f, size_t i, const Point<T, N>& s,
+                           std::vector<T>& minDist, std::vector<T>& maxMin) {
+        if (boxDistance_(f, i, s) >= maxMin[i]) return;
+        minDist[i] = std::min(minDist[i], Point<T, N>::squaredDistance(s, f.nodes[i]->point));
+        maxMin[i] = minDist[i];
+        size_t son = i + 1;
+        for (const Node* c : {f.nodes[i]->left.get(), f.nodes[i]->right.get()}) {
+            if (!c) continue;
+            fpsUpdate_(f, son, s, minDist, maxMin);
+            maxMin[i] = std::max(maxMin[i], maxMin[son]);
+            son += f.sizes[son];
+        }
+    }
+
+    // Point of largest minDist, found by following maxMin down from the root
+    static size_t fpsArgMax_(const Flat_& f, const std::vector<T>& minDist, const std::vector<T>& maxMin) {
+        size_t i = 0;
+        while (minDist[i] != maxMin[i]) {
+            size_t son = i + 1;
+            for (const Node* c : {f.nodes[i]->left.get(), f.nodes[i]->right.get()}) {
+                if (!c) continue;
+                if (maxMin[son] == maxMin[i]) break;
+                son += f.sizes[son];
+            }
+            i = son;
+        }
+        return i;
+    }
+
+    // Kernel density: reference subtrees (or single points) still to add
+    struct KdeItem_ {
+        const Node* node;
+        bool pointOnly;      // the node's point alone, not its subtree
+    };
+
+    struct KdeParams_ {
+        Kernel kernel;
+        double invH2;        // 1 / bandwidth^2
+        double relError;
+    };
+
+    // Kernel sum of one query (or of every query in a box) under way
+    struct KdeSum_ {
+        double sum = 0;      // approximate sum of the items already added
+        double lower = 0;    // lower bound of their exact sum
+        double error = 0;    // bound on the error of sum
+        double remaining;    // reference points not added yet
+    };
+
+    static double kernel_(const KdeParams_& k, double dist2) {
+        double u = dist2 * k.invH2;
+        if (k.kernel == Kernel::Gaussian) return std::exp(-0.5 * u);
+        return u < 1 ? 1 - u : 0;
+    }
+
+    // Add to s the items whose kernel values hardly vary over the query box
+    // [qlo, qhi], and replace the others by their point and sons. The error
+    // budget relError * (lower bound of the final sum) minus the error
+    // already made is shared among the remaining reference points, so the
+    // final error stays below relError times the exact sum.
+    static void kdeRefine_(const std::array<double, N>& qlo, const std::array<double, N>& qhi,
+                           std::vector<KdeItem_>& items, KdeSum_& s, const KdeParams_& k) {
+        struct Bounds { double kMin, kMax, count; };
+        std::vector<Bounds> bounds(items.size());
+        double itemsLower = 0;
+        for (size_t j = 0; j < items.size(); ++j) {
+            const Node* r = items[j].node;
+            double dMin2 = 0, dMax2 = 0;
+            for (size_t a = 0; a < N; ++a) {
+                double rlo = items[j].pointOnly ? double(r->point[a]) : double(r->lo[a]);
+                double rhi = items[j].pointOnly ? double(r->point[a]) : double(r->hi[a]);
+                double gap = std::max({rlo - qhi[a], qlo[a] - rhi, 0.0});
+                double far = std::max(rhi - qlo[a], qhi[a] - rlo);
+                dMin2 += gap * gap;
+                dMax2 += far * far;
+            }
+            bounds[j] = {kernel_(k, dMax2), kernel_(k, dMin2), items[j].pointOnly ? 1.0 : double(r->count)};
+            itemsLower += bounds[j].count * bounds[j].kMin;
+        }
+        double perPoint = std::max(0.0, k.relError * (s.lower + itemsLower) - s.error) / s.remaining;
+        std::vector<KdeItem_> next;
+        for (size_t j = 0; j < items.size(); ++j) {
+            const Bounds& b = bounds[j];
+            if ((b.kMax - b.kMin) / 2 <= perPoint) {
+                s.sum += b.count * (b.kMin + b.kMax) / 2;
+                s.lower += b.count * b.kMin;
+                s.error += b.count * (b.kMax - b.kMin) / 2;
+                s.remaining -= b.count;
+            } else if (items[j].pointOnly) {
+                next.push_back(items[j]);
+            } else {
+                next.push_back({items[j].node, true});
+                for (const Node* s : {items[j].node->left.get(), items[j].node->right.get()})
+                    if (s) next.push_back({s, false});
+            }
+        }
+        items = std::move(next);
+    }
+
+    // Kernel sum at q, refining the items down to single points if needed
+    static double kdeAtPoint_(const Point<T, N>& q, std::vector<KdeItem_> items, KdeSum_ s, const KdeParams_& k) {
+        std::array<double, N> qp;
+        for (size_t a = 0; a < N; ++a) qp[a] = double(q[a]);
+        while (!items.empty()) kdeRefine_(qp, qp, items, s, k);
+        return s.sum;
+    }
+
+    // Dual-tree pass: the queries order[b .. e) share the refinement of the
+    // items as long as they are many; the range is split at the median of
+    // its widest axis
+    static void kdeDual_(const std::vector<Point<T, N>>& queries, std::vector<size_t>& order, size_t b, size_t e,
+                         std::vector<KdeItem_> items, KdeSum_ s, const KdeParams_& k, std::vector<double>& out) {
+        const size_t leafSize = 8;
+        if (e - b <= leafSize) {
+            for (size_t i = b; i < e; ++i)
+                out[order[i]] = kdeAtPoint_(queries[order[i]], items, s, k);
+            return;
+        }
+        std::array<double, N> qlo, qhi;
+        qlo.fill(std::numeric_limits<double>::max());
+        qhi.fill(std::numeric_limits<double>::lowest());
+        for (size_t i = b; i < e; ++i)
+            for (size_t a = 0; a < N; ++a) {
+                qlo[a] = std::min(qlo[a], double(queries[order[i]][a]));
+                qhi[a] = std::max(qhi[a], double(queries[order[i]][a]));
+            }
+        kdeRefine_(qlo, qhi, items, s, k);
+        if (items.empty()) {
+            for (size_t i = b; i < e; ++i) out[order[i]] = s.sum;
+            return;
+        }
+        size_t axis = 0;
+        for (size_t a = 1; a < N; ++a)
+            if (qhi[a] - qlo[a] > qhi[axis] - qlo[axis]) axis = a;
+        size_t mid = b + (e - b) / 2;
+        std::nth_element(order.begin() + b, order.begin() + mid, order.begin() + e,
+                         [&](size_t i, size_t j) { return queries[i][axis] < queries[j][axis]; });
+        kdeDual_(queries, order, b, mid, items, s, k, out);
+        kdeDual_(queries, order, mid, e, std::move(items), s, k, out);
+    }
+
+    // Factor turning a kernel sum into a density
+    double kdeScale_(double bandwidth, Kernel kernel) const {
+        const double pi = 3.14159265358979323846;
+        double norm = kernel == Kernel::Gaussian
+            ? std::pow(2 * pi, -0.5 * N)
+            : (N + 2) / (2 * std::pow(pi, 0.5 * N) / std::tgamma(0.5 * N + 1));
+        return norm / (std::pow(bandwidth, double(N)) * double(root->count));
+    }
+
+    static size_t height_(const Node* node) {
+        if (!node) return 0;
+        return 1 + std::max(height_(node->left.get()), height_(node->right.get()));
+    }
+
+    // Nodes at depth d below node, left to right
+    static void atDepth_(Node* node, size_t d, std::vector<Node*>& out) {
+        if (!node) return;
+        if (d == 0) {
+            out.push_back(node);
+            return;
+        }
+        atDepth_(node->left.get(), d - 1, out);
+        atDepth_(node->right.get(), d - 1, out);
+    }
+
+    // Van Emde Boas order of the h top levels of the subtree at node: the
+    // top half of the levels, then each subtree hanging below it, each laid
+    // out recursively the same way
+    static void vanEmdeBoas_(Node* node, size_t h, std::vector<Node*>& out) {
+        if (!node) return;
+        if (h == 1) {
+            out.push_back(node);
+            return;
+        }
+        size_t top = h / 2;
+        vanEmdeBoas_(node, top, out);
+        std::vector<Node*> bottoms;
+        atDepth_(node, top, bottoms);
+        for (Node* b : bottoms) vanEmdeBoas_(b, h - top, out);
+    }
+
+    void compactIfDue_() {
+        if (compactEvery && ++changes >= compactEvery) compact();
     }
 
 public:
     void insert(const Point<T, N>& p)
     {
-        root = insert_(std::move(root), p, 0);
+        Nodes::insert(root, Link(new Node(p)), 0);
+        rnnReady = false;
+        compactIfDue_();
     }
 
     bool remove(const Point<T, N>& p)
     {
-        return remove_(root, p, 0);
+        rnnReady = false;
+        if (!Nodes::remove(root, p, 0, [](const Node&) { return true; })) return false;
+        compactIfDue_();
+        return true;
     }
 
     bool search(const Point<T, N>& p) const
@@ -129,10 +626,233 @@ public:
         return search_(root.get(), p, 0);
     }
 
+    // Points p with lo[i] <= p[i] <= hi[i] on every axis
+    std::vector<Point<T, N>> searchRange(const Point<T, N>& lo, const Point<T, N>& hi) const {
+        std::vector<Point<T, N>> out;
+        range_(root.get(), lo, hi, 0, out);
+        return out;
+    }
+
     Point<T, N> searchClosestNeighbor(const Point<T, N>& p) const {
         const Node* best = nullptr;
         T bestDist = std::numeric_limits<T>::max();
         nearestNeighbor_(root.get(), p, best, bestDist, 0);
         return best ? best->point : Point<T, N>({});
     }
+
+    // Point of the tree farthest from p, found by pruning the subtrees whose
+    // bounding box cannot hold a farther point
+    Point<T, N> searchFurthestNeighbor(const Point<T, N>& p) const {
+        if (!root) return Point<T, N>({});
+        const Node* best = nullptr;
+        T bestDist = 0;
+        furthestNeighbor_(root.get(), p, best, bestDist);
+        return best->point;
+    }
+
+    // Compute the nearest neighbour distance of every point, in parallel,
+    // for searchReverseNeighbors; to be called again after insert or remove
+    void prepareReverseNeighbors()
+    {
+        TraceSpan span("KDTree::prepareReverseNeighbors");
+        std::vector<Node*> nodes;
+        collectNodes_(root.get(), nodes);
+        parallelFor(nodes.size(), [&](size_t i) {
+            const Node* best = nullptr;
+            T bestDist = std::numeric_limits<T>::max();
+            nearestOther_(root.get(), nodes[i], nodes[i]->point, best, bestDist, 0);
+            nodes[i]->nnDist2 = bestDist;
+        }, 1024);
+        maxNnDist2_(root.get());
+        rnnReady = true;
+    }
+
+    // Reverse nearest neighbours of q: the points other than q that have no
+    // other point strictly closer than q
+    std::vector<Point<T, N>> searchReverseNeighbors(const Point<T, N>& q) const
+    {
+        if (!rnnReady) throw std::logic_error("prepareReverseNeighbors must be called first");
+        std::array<T, N> lo, hi;
+        lo.fill(std::numeric_limits<T>::lowest());
+        hi.fill(std::numeric_limits<T>::max());
+        std::vector<Point<T, N>> out;
+        reverseNeighbors_(root.get(), q, lo, hi, 0, out);
+        return out;
+    }
+
+    // searchReverseNeighbors for each query, the queries run in parallel
+    std::vector<std::vector<Point<T, N>>> searchReverseNeighbors(const std::vector<Point<T, N>>& queries) const
+    {
+        if (!rnnReady) throw std::logic_error("prepareReverseNeighbors must be called first");
+        TraceSpan span("KDTree::searchReverseNeighbors", queries.size());
+        std::vector<std::vector<Point<T, N>>> out(queries.size());
+        parallelFor(queries.size(), [&](size_t i) { out[i] = searchReverseNeighbors(queries[i]); }, 64);
+        return out;
+    }
+
+    struct Edge {
+        Point<T, N> a, b;
+        T dist2;             // squared length
+    };
+
+    // Closest pair of distinct points (in the tree, duplicates are distinct)
+    Edge closestPair() const
+    {
+        TraceSpan span("KDTree::closestPair");
+        std::vector<const Node*> nodes;
+        collectNodes_<const Node*>(root.get(), nodes);
+        if (nodes.size() < 2) throw std::length_error("closestPair needs 2 points");
+        std::vector<const Node*> nearest(nodes.size());
+        std::vector<T> dist(nodes.size(), std::numeric_limits<T>::max());
+        parallelFor(nodes.size(), [&](size_t i) {
+            nearestOther_(root.get(), nodes[i], nodes[i]->point, nearest[i], dist[i], 0);
+        }, 1024);
+        size_t i = std::min_element(dist.begin(), dist.end()) - dist.begin();
+        return {nodes[i]->point, nearest[i]->point, dist[i]};
+    }
+
+    // Euclidean minimum spanning tree, by Boruvka: each round, the components
+    // (in parallel) look for their shortest edge to another component, point
+    // by point, the best edge so far bounding the search of the next point.
+    // These edges join the components, which at least halves their number.
+    std::vector<Edge> minimumSpanningTree() const
+    {
+        TraceSpan span("KDTree::minimumSpanningTree");
+        Flat_ f = flatten_();
+        size_t n = f.nodes.size();
+        std::vector<Edge> edges;
+        if (n < 2) return edges;
+        std::vector<size_t> parent(n), comp(n), uniform(n), members(n), first(n + 1);
+        for (size_t i = 0; i < n; ++i) parent[i] = i;
+        struct Best { size_t from, to; T dist2; };
+        for (size_t nComponents = n; nComponents > 1;) {
+            TraceSpan round("Boruvka round", nComponents);
+            for (size_t i = 0; i < n; ++i) comp[i] = findRoot_(parent, i);
+            for (size_t i = n; i-- > 0;) {
+                uniform[i] = comp[i];
+                for (size_t son = i + 1; son < i + f.sizes[i]; son += f.sizes[son])
+                    if (uniform[son] != comp[i]) uniform[i] = none_;
+            }
+            // Points grouped by component: members[first[c] .. first[c + 1])
+            std::fill(first.begin(), first.end(), 0);
+            for (size_t i = 0; i < n; ++i) first[comp[i] + 1]++;
+            for (size_t c = 0; c < n; ++c) first[c + 1] += first[c];
+            std::vector<size_t> next(first.begin(), first.end() - 1);
+            for (size_t i = 0; i < n; ++i) members[next[comp[i]]++] = i;
+            std::vector<size_t> roots;
+            for (size_t c = 0; c < n; ++c)
+                if (first[c + 1] > first[c]) roots.push_back(c);
+
+            // Ties are broken on the point indices, so that the chosen edges
+            // never make a cycle
+            std::vector<Best> shortest(roots.size());
+            parallelFor(roots.size(), [&](size_t r) {
+                Best b{none_, none_, std::numeric_limits<T>::max()};
+                for (size_t k = first[roots[r]]; k < first[roots[r] + 1]; ++k) {
+                    size_t q = members[k], to = none_;
+                    T dist2 = b.dist2;
+                    nearestForeign_(f, 0, q, comp, uniform, to, dist2);
+                    if (to != none_ && (dist2 < b.dist2 || std::minmax(q, to) < std::minmax(b.from, b.to)))
+                        b = {q, to, dist2};
+                }
+                shortest[r] = b;
+            }, 64);
+            for (const Best& b : shortest) {
+                size_t x = findRoot_(parent, b.from), y = findRoot_(parent, b.to);
+                if (x == y) continue;
+                parent[x] = y;
+                nComponents--;
+                edges.push_back({f.nodes[b.from]->point, f.nodes[b.to]->point, b.dist2});
+            }
+        }
+        return edges;
+    }
+
+    // k points spread over the tree by farthest point sampling: starting from
+    // the root's point, each sample is the point farthest from the samples
+    // already taken. Fewer than k if the tree holds fewer distinct points.
+    std::vector<Point<T, N>> farthestPointSampling(size_t k) const
+    {
+        TraceSpan span("KDTree::farthestPointSampling", k);
+        std::vector<Point<T, N>> samples;
+        if (!root || k == 0) return samples;
+        Flat_ f = flatten_();
+        size_t n = f.nodes.size();
+        std::vector<T> minDist(n, std::numeric_limits<T>::max()), maxMin(n, std::numeric_limits<T>::max());
+        size_t next = 0;
+        while (samples.size() < k) {
+            samples.push_back(f.nodes[next]->point);
+            fpsUpdate_(f, 0, samples.back(), minDist, maxMin);
+            if (maxMin[0] == 0) break;
+            next = fpsArgMax_(f, minDist, maxMin);
+        }
+        return samples;
+    }
+
+    // Kernel density estimate at q, within relError of the exact value
+    double kernelDensity(const Point<T, N>& q, double bandwidth, Kernel kernel = Kernel::Gaussian,
+                         double relError = 1e-2) const
+    {
+        if (!root) return 0;
+        KdeParams_ k{kernel, 1 / (bandwidth * bandwidth), relError};
+        KdeSum_ s;
+        s.remaining = double(root->count);
+        return kdeAtPoint_(q, {{root.get(), false}}, s, k) * kdeScale_(bandwidth, kernel);
+    }
+
+    // kernelDensity at every query, by a dual-tree traversal: nearby queries
+    // share the approximations of the reference subtrees
+    std::vector<double> kernelDensity(const std::vector<Point<T, N>>& queries, double bandwidth,
+                                      Kernel kernel = Kernel::Gaussian, double relError = 1e-2) const
+    {
+        TraceSpan span("KDTree::kernelDensity", queries.size());
+        std::vector<double> out(queries.size(), 0);
+        if (!root || queries.empty()) return out;
+        KdeParams_ k{kernel, 1 / (bandwidth * bandwidth), relError};
+        KdeSum_ s;
+        s.remaining = double(root->count);
+        std::vector<size_t> order(queries.size());
+        for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+        kdeDual_(queries, order, 0, order.size(), {{root.get(), false}}, s, k, out);
+        double scale = kdeScale_(bandwidth, kernel);
+        for (double& d : out) d *= scale;
+        return out;
+    }
+
+    // Move all the nodes, in the given order, to one new contiguous block,
+    // the shape of the tree being kept: after many inserts and removes, this
+    // brings back the locality of a fresh tree without rebuilding it
+    void compact(Layout layout = Layout::VanEmdeBoas)
+    {
+        TraceSpan span("KDTree::compact");
+        changes = 0;
+        if (!root) return;
+        std::vector<Node*> order;
+        if (layout == Layout::DepthFirst)
+            collectNodes_<Node*>(root.get(), order);
+        else
+            vanEmdeBoas_(root.get(), height_(root.get()), order);
+
+        std::unordered_map<const Node*, size_t> position;
+        for (size_t i = 0; i < order.size(); ++i) position[order[i]] = i;
+        Block* block = new Block{std::allocator<Node>().allocate(order.size()), order.size(), order.size()};
+        for (size_t i = 0; i < order.size(); ++i) {
+            Node* copy = new (block->nodes + i) Node(order[i]->point);
+            copy->nnDist2 = order[i]->nnDist2;
+            copy->maxNnDist2 = order[i]->maxNnDist2;
+            copy->count = order[i]->count;
+            copy->lo = order[i]->lo;
+            copy->hi = order[i]->hi;
+            copy->block = block;
+        }
+        for (size_t i = 0; i < order.size(); ++i) {
+            if (order[i]->left) block->nodes[i].left.reset(block->nodes + position[order[i]->left.get()]);
+            if (order[i]->right) block->nodes[i].right.reset(block->nodes + position[order[i]->right.get()]);
+        }
+        Link newRoot(block->nodes + position[root.get()]);
+        root = std::move(newRoot);
+    }
+
+    // Run compact() by itself after every n inserts and removes (0: never)
+    void setCompactionInterval(size_t n) { compactEvery = n; }
 };
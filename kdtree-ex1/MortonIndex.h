@@ -0,0 +1,258 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include "KDTree.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+// Static spatial index bulk-built from Morton codes (LBVH, Karras 2012):
+// points are quantized on their bounding box, their Morton codes sorted with
+// a parallel LSD radix sort, and the binary hierarchy derived from the sorted
+// codes, each internal node independently. Each node keeps the bounding box of
+// its points. Meant for low dimensions (64 / N bits per axis); answers the
+// same queries as KDTree (search, searchRange, searchClosestNeighbor).
+template <typename T, size_t N>
+class MortonIndex {
+    static_assert(N >= 1 && N <= 8, "Morton codes need a low dimension");
+    static const int bitsPerAxis = N == 1 ? 32 : 64 / N;
+
+    struct Box {
+        std::array<T, N> lo, hi;
+    };
+
+    // Internal nodes are 0 .. n-2, a child index with leafFlag set is a leaf
+    static const uint32_t leafFlag = 0x80000000u;
+    struct InternalNode {
+        uint32_t left, right;
+    };
+
+    std::vector<Point<T, N>> points;           // sorted by Morton code: leaf i is points[i]
+    std::vector<uint64_t> codes;
+    std::vector<InternalNode> nodes;
+    std::vector<Box> boxes;                    // bounding boxes of the internal nodes
+
+    static uint64_t interleave_(const std::array<uint64_t, N>& q) {
+        uint64_t code = 0;
+        for (int b = bitsPerAxis - 1; b >= 0; --b)
+            for (size_t a = 0; a < N; ++a)
+                code = (code << 1) | ((q[a] >> b) & 1);
+        return code;
+    }
+
+    // Sort keys (and the permutation idx along) with 8-bit LSD passes,
+    // each pass counting and scattering chunks of the input in parallel
+    static void radixSort_(std::vector<uint64_t>& keys, std::vector<uint32_t>& idx) {
+        size_t n = keys.size();
+        size_t nChunks = std::max<size_t>(1, std::min<size_t>(WorkStealingPool::global().size(), n / 65536));
+        size_t chunk = (n + nChunks - 1) / nChunks;
+        std::vector<uint64_t> keysTmp(n);
+        std::vector<uint32_t> idxTmp(n);
+        std::vector<std::array<size_t, 256>> counts(nChunks);
+        for (int shift = 0; shift < 64; shift += 8) {
+            parallelFor(nChunks, [&](size_t c) {
+                counts[c].fill(0);
+                for (size_t i = c * chunk; i < std::min(n, (c + 1) * chunk); ++i)
+                    counts[c][(keys[i] >> shift) & 0xff]++;
+            });
+            // Skip the pass when every key has the same digit
+            size_t total0 = 0;
+            for (size_t c = 0; c < nChunks; ++c) total0 += counts[c][(keys[0] >> shift) & 0xff];
+            if (total0 == n) continue;
+            // Turn the counts into the start offset of each (digit, chunk)
+            size_t offset = 0;
+            for (int d = 0; d < 256; ++d)
+                for (size_t c = 0; c < nChunks; ++c) {
+                    size_t k = counts[c][d];
+                    counts[c][d] = offset;
+                    offset += k;
+                }
+            parallelFor(nChunks, [&](size_t c) {
+                for (size_t i = c * chunk; i < std::min(n, (c + 1) * chunk); ++i) {
+                    size_t pos = counts[c][(keys[i] >> shift) & 0xff]++;
+                    keysTmp[pos] = keys[i];
+                    idxTmp[pos] = idx[i];
+                }
+            });
+            keys.swap(keysTmp);
+            idx.swap(idxTmp);
+        }
+    }
+
+    // Length of the common prefix of the keys at i and j (-1 out of range),
+    // equal codes being told apart by their index
+    int delta_(int64_t i, int64_t j) const {
+        if (j < 0 || j >= int64_t(codes.size())) return -1;
+        uint64_t x = codes[i] ^ codes[j];
+        if (x == 0) return 64 + std::countl_zero(uint64_t(i ^ j));
+        return std::countl_zero(x);
+    }
+
+    void buildNode_(int64_t i) {
+        int d = (delta_(i, i + 1) - delta_(i, i - 1)) >= 0 ? 1 : -1;
+        // Find the other end of the range covered by node i
+        int deltaMin = delta_(i, i - d);
+        int64_t lMax = 2;
+        while (delta_(i, i + lMax * d) > deltaMin) lMax *= 2;
+        int64_t l = 0;
+        for (int64_t t = lMax / 2; t >= 1; t /= 2)
+            if (delta_(i, i + (l + t) * d) > deltaMin) l += t;
+        int64_t j = i + l * d;
+        // Find where the range splits
+        int deltaNode = delta_(i, j);
+        int64_t s = 0;
+        for (int64_t div = 2, t; ; div *= 2) {
+            t = (l + div - 1) / div;
+            if (delta_(i, i + (s + t) * d) > deltaNode) s += t;
+            if (t <= 1) break;
+        }
+        int64_t gamma = i + s * d + std::min(d, 0);
+        nodes[i].left = uint32_t(gamma) | (std::min(i, j) == gamma ? leafFlag : 0);
+        nodes[i].right = uint32_t(gamma + 1) | (std::max(i, j) == gamma + 1 ? leafFlag : 0);
+    }
+
+    Box boxOf_(uint32_t child) const {
+        if (child & leafFlag) {
+            const Point<T, N>& p = points[child & ~leafFlag];
+            Box b;
+            for (size_t a = 0; a < N; ++a) b.lo[a] = b.hi[a] = p[a];
+            return b;
+        }
+        return boxes[child];
+    }
+
+    void computeBoxes_(uint32_t node) {
+        for (uint32_t child : {nodes[node].left, nodes[node].right})
+            if (!(child & leafFlag)) computeBoxes_(child);
+        Box l = boxOf_(nodes[node].left), r = boxOf_(nodes[node].right);
+        for (size_t a = 0; a < N; ++a) {
+            boxes[node].lo[a] = std::min(l.lo[a], r.lo[a]);
+            boxes[node].hi[a] = std::max(l.hi[a], r.hi[a]);
+        }
+    }
+
+    static T boxDistance_(const Box& b, const Point<T, N>& p) {
+        T sum = 0;
+        for (size_t a = 0; a < N; ++a) {
+            T diff = p[a] < b.lo[a] ? b.lo[a] - p[a] : (p[a] > b.hi[a] ? p[a] - b.hi[a] : 0);
+            sum += diff * diff;
+        }
+        return sum;
+    }
+
+    void nearestNeighbor_(uint32_t child, const Point<T, N>& target, const Point<T, N>*& best, T& bestDist) const {
+        if (child & leafFlag) {
+            const Point<T, N>& p = points[child & ~leafFlag];
+            T d = Point<T, N>::squaredDistance(target, p);
+            if (d < bestDist) {
+                bestDist = d;
+                best = &p;
+            }
+            return;
+        }
+        uint32_t first = nodes[child].left, second = nodes[child].right;
+        T dFirst = boxDistance_(boxOf_(first), target), dSecond = boxDistance_(boxOf_(second), target);
+        if (dSecond < dFirst) {
+            std::swap(first, second);
+            std::swap(dFirst, dSecond);
+        }
+        if (dFirst < bestDist) nearestNeighbor_(first, target, best, bestDist);
+        if (dSecond < bestDist) nearestNeighbor_(second, target, best, bestDist);
+    }
+
+    template <typename F>
+    void visitBox_(uint32_t child, const Point<T, N>& lo, const Point<T, N>& hi, F&& f) const {
+        if (child & leafFlag) {
+            const Point<T, N>& p = points[child & ~leafFlag];
+            for (size_t a = 0; a < N; ++a)
+                if (p[a] < lo[a] || p[a] > hi[a]) return;
+            f(p);
+            return;
+        }
+        const Box& b = boxes[child];
+        for (size_t a = 0; a < N; ++a)
+            if (b.hi[a] < lo[a] || b.lo[a] > hi[a]) return;
+        visitBox_(nodes[child].left, lo, hi, f);
+        visitBox_(nodes[child].right, lo, hi, f);
+    }
+
+    uint32_t root_() const { return points.size() == 1 ? leafFlag : 0; }
+
+public:
+    explicit MortonIndex(const std::vector<Point<T, N>>& input)
+    {
+        size_t n = input.size();
+        if (n == 0) return;
+        TraceSpan span("MortonIndex build", n);
+
+        // Quantize on the bounding box
+        Box bounds;
+        for (size_t a = 0; a < N; ++a) bounds.lo[a] = bounds.hi[a] = input[0][a];
+        for (const auto& p : input)
+            for (size_t a = 0; a < N; ++a) {
+                bounds.lo[a] = std::min(bounds.lo[a], p[a]);
+                bounds.hi[a] = std::max(bounds.hi[a], p[a]);
+            }
+        double cells = double((uint64_t(1) << bitsPerAxis) - 1);
+        std::array<double, N> scale;
+        for (size_t a = 0; a < N; ++a) {
+            double extent = double(bounds.hi[a]) - double(bounds.lo[a]);
+            scale[a] = extent > 0 ? cells / extent : 0;
+        }
+        std::vector<uint64_t> keys(n);
+        std::vector<uint32_t> idx(n);
+        parallelFor(n, [&](size_t i) {
+            std::array<uint64_t, N> q;
+            for (size_t a = 0; a < N; ++a)
+                q[a] = uint64_t((double(input[i][a]) - double(bounds.lo[a])) * scale[a]);
+            keys[i] = interleave_(q);
+            idx[i] = uint32_t(i);
+        }, 4096);
+
+        {
+            TraceSpan sort("MortonIndex radix sort", n);
+            radixSort_(keys, idx);
+        }
+        codes = std::move(keys);
+        points.reserve(n);
+        for (uint32_t i : idx) points.push_back(input[i]);
+
+        if (n == 1) return;
+        nodes.resize(n - 1);
+        boxes.resize(n - 1);
+        TraceSpan hierarchy("MortonIndex hierarchy", n);
+        parallelFor(n - 1, [this](size_t i) { buildNode_(int64_t(i)); }, 4096);
+        computeBoxes_(0);
+    }
+
+    size_t size() const { return points.size(); }
+
+    bool search(const Point<T, N>& p) const
+    {
+        bool found = false;
+        if (!points.empty())
+            visitBox_(root_(), p, p, [&found](const Point<T, N>&) { found = true; });
+        return found;
+    }
+
+    // Points q with lo[i] <= q[i] <= hi[i] on every axis
+    std::vector<Point<T, N>> searchRange(const Point<T, N>& lo, const Point<T, N>& hi) const
+    {
+        std::vector<Point<T, N>> out;
+        if (!points.empty())
+            visitBox_(root_(), lo, hi, [&out](const Point<T, N>& q) { out.push_back(q); });
+        return out;
+    }
+
+    Point<T, N> searchClosestNeighbor(const Point<T, N>& p) const
+    {
+        const Point<T, N>* best = nullptr;
+        T bestDist = std::numeric_limits<T>::max();
+        if (!points.empty())
+            nearestNeighbor_(root_(), p, best, bestDist);
+        return best ? *best : Point<T, N>({});
+    }
+};
@@ -0,0 +1,231 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+#include "KDTree.h"
+#include "quadtree.h"
+
+// Bucket point-region quadtree over the square [x0, x0 + side) x [y0, y0 + side)
+// Regions are split at their centre into the NW/NE/SE/SW quadrants of quadtree.h
+// (north = smaller y); a leaf holds up to bucketSize points before splitting.
+template <typename T>
+class PRQuadTree {
+    using P = Point<T, 2>;
+
+    struct Node {
+        std::vector<P> bucket;                       // leaf only
+        std::array<std::unique_ptr<Node>, nQuadDir> sons;
+        bool isLeaf() const { return !sons[0]; }
+    };
+
+    std::unique_ptr<Node> root = std::make_unique<Node>();
+    T x0, y0, side;
+    size_t bucketSize;
+    size_t count = 0;
+
+    // Smallest region that is still split: 2 units for integer coordinates,
+    // 2^-24 of the whole side otherwise (so that duplicates stop splitting)
+    bool canSplit_(T s) const {
+        if constexpr (std::is_integral_v<T>) return s >= 2;
+        else return s / 2 >= side / (1 << 24);
+    }
+
+    static int direction_(const P& p, T midX, T midY) {
+        return (p[1] < midY) ? (p[0] < midX ? NW : NE) : (p[0] < midX ? SW : SE);
+    }
+
+    static void sonRegion_(int d, T& x, T& y, T half) {
+        if (d == NE || d == SE) x += half;
+        if (d == SE || d == SW) y += half;
+    }
+
+    void split_(Node* node, T x, T y, T s) {
+        T half = s / 2;
+        for (auto& son : node->sons) son = std::make_unique<Node>();
+        for (const P& q : node->bucket)
+            node->sons[direction_(q, x + half, y + half)]->bucket.push_back(q);
+        node->bucket.clear();
+        node->bucket.shrink_to_fit();
+        for (int d = 0; d < nQuadDir; d++) {
+            T sx = x, sy = y;
+            sonRegion_(d, sx, sy, half);
+            Node* son = node->sons[d].get();
+            if (son->bucket.size() > bucketSize && canSplit_(half))
+                split_(son, sx, sy, half);
+        }
+    }
+
+    void insert_(Node* node, const P& p, T x, T y, T s) {
+        while (!node->isLeaf()) {
+            T half = s / 2;
+            int d = direction_(p, x + half, y + half);
+            sonRegion_(d, x, y, half);
+            s = half;
+            node = node->sons[d].get();
+        }
+        node->bucket.push_back(p);
+        // Regions that cannot be halved any more keep an oversized bucket
+        if (node->bucket.size() > bucketSize && canSplit_(s))
+            split_(node, x, y, s);
+    }
+
+    // Number of points below node, stopping as soon as it exceeds limit
+    size_t size_(const Node* node, size_t limit) const {
+        if (node->isLeaf()) return node->bucket.size();
+        size_t n = 0;
+        for (const auto& son : node->sons) {
+            n += size_(son.get(), limit);
+            if (n > limit) break;
+        }
+        return n;
+    }
+
+    void collect_(Node* node, std::vector<P>& out) const {
+        if (node->isLeaf()) {
+            out.insert(out.end(), node->bucket.begin(), node->bucket.end());
+            return;
+        }
+        for (auto& son : node->sons) collect_(son.get(), out);
+    }
+
+    bool remove_(Node* node, const P& p, T x, T y, T s) {
+        if (node->isLeaf()) {
+            auto it = std::find(node->bucket.begin(), node->bucket.end(), p);
+            if (it == node->bucket.end()) return false;
+            *it = node->bucket.back();
+            node->bucket.pop_back();
+            return true;
+        }
+        T half = s / 2;
+        int d = direction_(p, x + half, y + half);
+        sonRegion_(d, x, y, half);
+        if (!remove_(node->sons[d].get(), p, x, y, half)) return false;
+        // Merge the sons back into one bucket once they fit in it
+        if (size_(node, bucketSize) <= bucketSize) {
+            std::vector<P> points;
+            collect_(node, points);
+            for (auto& son : node->sons) son.reset();
+            node->bucket = std::move(points);
+        }
+        return true;
+    }
+
+    // Squared distance from p to the region [x, x + s) x [y, y + s)
+    static T regionDistance_(const P& p, T x, T y, T s) {
+        T dx = p[0] < x ? x - p[0] : (p[0] > x + s ? p[0] - (x + s) : 0);
+        T dy = p[1] < y ? y - p[1] : (p[1] > y + s ? p[1] - (y + s) : 0);
+        return dx * dx + dy * dy;
+    }
+
+    void nearestNeighbor_(const Node* node, const P& target, T x, T y, T s, const P*& best, T& bestDist) const {
+        if (node->isLeaf()) {
+            for (const P& q : node->bucket) {
+                T d = P::squaredDistance(target, q);
+                if (d < bestDist) {
+                    bestDist = d;
+                    best = &q;
+                }
+            }
+            return;
+        }
+        // Visit the quadrants closest first, skipping those farther than the best
+        T half = s / 2;
+        std::array<std::pair<T, int>, nQuadDir> order;
+        for (int d = 0; d < nQuadDir; d++) {
+            T sx = x, sy = y;
+            sonRegion_(d, sx, sy, half);
+            order[d] = {regionDistance_(target, sx, sy, half), d};
+        }
+        std::sort(order.begin(), order.end());
+        for (auto [dist, d] : order) {
+            if (dist >= bestDist) break;
+            T sx = x, sy = y;
+            sonRegion_(d, sx, sy, half);
+            nearestNeighbor_(node->sons[d].get(), target, sx, sy, half, best, bestDist);
+        }
+    }
+
+    void range_(const Node* node, const P& lo, const P& hi, T x, T y, T s, std::vector<P>& out) const {
+        if (hi[0] < x || hi[1] < y || lo[0] >= x + s || lo[1] >= y + s) return;
+        if (node->isLeaf()) {
+            for (const P& q : node->bucket)
+                if (lo[0] <= q[0] && q[0] <= hi[0] && lo[1] <= q[1] && q[1] <= hi[1])
+                    out.push_back(q);
+            return;
+        }
+        T half = s / 2;
+        for (int d = 0; d < nQuadDir; d++) {
+            T sx = x, sy = y;
+            sonRegion_(d, sx, sy, half);
+            range_(node->sons[d].get(), lo, hi, sx, sy, half, out);
+        }
+    }
+
+    void checkBounds_(const P& p) const {
+        if (p[0] < x0 || p[1] < y0 || p[0] >= x0 + side || p[1] >= y0 + side)
+            throw std::out_of_range("Point out of the quadtree region");
+    }
+
+public:
+    // With integer coordinates the side is rounded up to a power of two,
+    // so that every region splits into 4 equal quadrants
+    PRQuadTree(T x0, T y0, T side, size_t bucketSize = 16)
+        : x0(x0), y0(y0), side(side), bucketSize(bucketSize)
+    {
+        if constexpr (std::is_integral_v<T>) {
+            T s = 1;
+            while (s < side) s *= 2;
+            this->side = s;
+        }
+    }
+
+    size_t size() const { return count; }
+
+    void insert(const P& p)
+    {
+        checkBounds_(p);
+        insert_(root.get(), p, x0, y0, side);
+        count++;
+    }
+
+    bool remove(const P& p)
+    {
+        if (!remove_(root.get(), p, x0, y0, side)) return false;
+        count--;
+        return true;
+    }
+
+    bool search(const P& p) const
+    {
+        const Node* node = root.get();
+        T x = x0, y = y0, s = side;
+        while (!node->isLeaf()) {
+            T half = s / 2;
+            int d = direction_(p, x + half, y + half);
+            sonRegion_(d, x, y, half);
+            s = half;
+            node = node->sons[d].get();
+        }
+        return std::find(node->bucket.begin(), node->bucket.end(), p) != node->bucket.end();
+    }
+
+    // Points in the box [lo[0], hi[0]] x [lo[1], hi[1]]
+    std::vector<P> searchRange(const P& lo, const P& hi) const
+    {
+        std::vector<P> out;
+        range_(root.get(), lo, hi, x0, y0, side, out);
+        return out;
+    }
+
+    P searchClosestNeighbor(const P& p) const
+    {
+        const P* best = nullptr;
+        T bestDist = std::numeric_limits<T>::max();
+        nearestNeighbor_(root.get(), p, x0, y0, side, best, bestDist);
+        return best ? *best : P({});
+    }
+};
@@ -0,0 +1,330 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <mutex>
+#include <ostream>
+#include <shared_mutex>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include "KDTree.h"
+
+// Capture and replay of the operations applied to a spatial index.
+//
+// A capture is a header then one record per operation:
+//   header: "KDWL", version, N, sizeof(T), 1 if T is floating point
+//   record: kind byte, time since the previous record in ns (varint),
+//           the point (the two corners for Range)
+// Integer coordinates are zigzag varints, floating point ones raw bytes in
+// the byte order of the host.
+
+enum class OpKind : uint8_t { Insert, Remove, Search, Nearest, Range };
+
+const size_t nOpKinds = 5;
+
+inline const char* opName(OpKind kind) {
+    static const char* names[nOpKinds] = {"insert", "remove", "search", "nearest", "range"};
+    return names[size_t(kind)];
+}
+
+template <typename T, size_t N>
+struct Op {
+    OpKind kind;
+    uint64_t time;           // ns since the start of the capture
+    Point<T, N> a, b;        // b: upper corner of a Range, unused otherwise
+};
+
+template <typename T, size_t N>
+class WorkloadWriter {
+    static_assert(N <= 255 && sizeof(T) <= 255, "The header stores N and sizeof(T) in one byte each");
+    std::ostream& os;
+    uint64_t lastTime = 0;
+
+    void putVarint_(uint64_t v) {
+        while (v >= 0x80) {
+            os.put(char((v & 0x7f) | 0x80));
+            v >>= 7;
+        }
+        os.put(char(v));
+    }
+
+    void putPoint_(const Point<T, N>& p) {
+        for (size_t i = 0; i < N; ++i) {
+            if constexpr (std::is_integral_v<T>) {
+                int64_t v = int64_t(p[i]);
+                putVarint_((uint64_t(v) << 1) ^ uint64_t(v >> 63));
+            } else {
+                T v = p[i];
+                unsigned char bytes[sizeof(T)];
+                std::memcpy(bytes, &v, sizeof(T));
+                os.write(reinterpret_cast<const char*>(bytes), sizeof(T));
+            }
+        }
+    }
+
+public:
+    explicit WorkloadWriter(std::ostream& os) : os(os) {
+        os.write("KDWL", 4);
+        os.put(char(1));
+        os.put(char(N));
+        os.put(char(sizeof(T)));
+        os.put(char(std::is_floating_point_v<T>));
+    }
+
+    // Operations must come in time order
+    void write(const Op<T, N>& op) {
+        os.put(char(op.kind));
+        putVarint_(op.time - std::min(lastTime, op.time));
+        lastTime = std::max(lastTime, op.time);
+        putPoint_(op.a);
+        if (op.kind == OpKind::Range) putPoint_(op.b);
+    }
+};
+
+// Throws runtime_error on a malformed capture or one of another Point type
+template <typename T, size_t N>
+class WorkloadReader {
+    static_assert(N <= 255 && sizeof(T) <= 255, "The header stores N and sizeof(T) in one byte each");
+    std::istream& is;
+    uint64_t lastTime = 0;
+
+    int get_() {
+        int c = is.get();
+        if (c == EOF) throw std::runtime_error("Truncated workload");
+        return c;
+    }
+
+    uint64_t getVarint_() {
+        uint64_t v = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            int b = get_();
+            v |= uint64_t(b & 0x7f) << shift;
+            if (!(b & 0x80)) return v;
+        }
+        throw std::runtime_error("Bad varint in workload");
+    }
+
+    Point<T, N> getPoint_() {
+        std::array<T, N> p;
+        for (size_t i = 0; i < N; ++i) {
+            if constexpr (std::is_integral_v<T>) {
+                uint64_t z = getVarint_();
+                p[i] = T(int64_t(z >> 1) ^ -int64_t(z & 1));
+            } else {
+                unsigned char bytes[sizeof(T)];
+                if (!is.read(reinterpret_cast<char*>(bytes), sizeof(T))) throw std::runtime_error("Truncated workload");
+                std::memcpy(&p[i], bytes, sizeof(T));
+            }
+        }
+        return Point<T, N>(p);
+    }
+
+public:
+    explicit WorkloadReader(std::istream& is) : is(is) {
+        char magic[4];
+        if (!is.read(magic, 4) || std::memcmp(magic, "KDWL", 4) != 0)
+            throw std::runtime_error("Not a workload capture");
+        if (get_() != 1) throw std::runtime_error("Unknown workload version");
+        if (get_() != int(N) || get_() != int(sizeof(T)) || get_() != int(std::is_floating_point_v<T>))
+            throw std::runtime_error("Workload recorded with another point type");
+    }
+
+    // Next operation; false at the end of the capture
+    bool next(Op<T, N>& op) {
+        int kind = is.get();
+        if (kind == EOF) return false;
+        if (kind >= int(nOpKinds)) throw std::runtime_error("Bad operation in workload");
+        op.kind = OpKind(kind);
+        lastTime += getVarint_();
+        op.time = lastTime;
+        op.a = getPoint_();
+        op.b = op.kind == OpKind::Range ? getPoint_() : op.a;
+        return true;
+    }
+
+    std::vector<Op<T, N>> readAll() {
+        std::vector<Op<T, N>> ops;
+        Op<T, N> op{OpKind::Insert, 0, Point<T, N>({}), Point<T, N>({})};
+        while (next(op)) ops.push_back(op);
+        return ops;
+    }
+};
+
+// KDTree that writes every operation applied to it into a capture; the
+// operations are serialized, so it may be shared by several threads
+template <typename T, size_t N>
+class RecordingKDTree {
+    KDTree<T, N> tree;
+    mutable WorkloadWriter<T, N> writer;    // recording does not change the tree
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    mutable std::mutex lock;
+
+    void record_(OpKind kind, const Point<T, N>& a, const Point<T, N>& b) const {
+        uint64_t t = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        writer.write({kind, t, a, b});
+    }
+
+public:
+    explicit RecordingKDTree(std::ostream& os) : writer(os) {}
+
+    void insert(const Point<T, N>& p) {
+        std::lock_guard<std::mutex> guard(lock);
+        record_(OpKind::Insert, p, p);
+        tree.insert(p);
+    }
+
+    bool remove(const Point<T, N>& p) {
+        std::lock_guard<std::mutex> guard(lock);
+        record_(OpKind::Remove, p, p);
+        return tree.remove(p);
+    }
+
+    bool search(const Point<T, N>& p) const {
+        std::lock_guard<std::mutex> guard(lock);
+        record_(OpKind::Search, p, p);
+        return tree.search(p);
+    }
+
+    Point<T, N> searchClosestNeighbor(const Point<T, N>& p) const {
+        std::lock_guard<std::mutex> guard(lock);
+        record_(OpKind::Nearest, p, p);
+        return tree.searchClosestNeighbor(p);
+    }
+
+    std::vector<Point<T, N>> searchRange(const Point<T, N>& lo, const Point<T, N>& hi) const {
+        std::lock_guard<std::mutex> guard(lock);
+        record_(OpKind::Range, lo, hi);
+        return tree.searchRange(lo, hi);
+    }
+
+    const KDTree<T, N>& index() const { return tree; }
+};
+
+// Latencies of a replay, per kind of operation
+struct ReplayStats {
+    double seconds = 0;                                  // first scheduled op to last completion
+    std::array<std::vector<double>, nOpKinds> latencies; // ns, sorted
+    size_t skipped = 0;                                  // ops the index does not support
+    // Sum of the found points, the range sizes and the nearest squared
+    // distances: indexes giving the same answers (in a single-thread
+    // replay) have the same checksum
+    size_t checksum = 0;
+
+    size_t count() const {
+        size_t n = 0;
+        for (const auto& l : latencies) n += l.size();
+        return n;
+    }
+
+    double throughput() const { return seconds > 0 ? count() / seconds : 0; }
+
+    // p-th percentile (0 <= p <= 100) of one kind of operation, in ns
+    double percentile(OpKind kind, double p) const {
+        const std::vector<double>& l = latencies[size_t(kind)];
+        if (l.empty()) return 0;
+        return l[std::min(l.size() - 1, size_t(p / 100 * l.size()))];
+    }
+};
+
+struct ReplayOptions {
+    unsigned threads = 1;
+    // Open loop: op i is issued at its capture time divided by speed, and its
+    // latency counts from that time, so a stalled index also delays the ops
+    // queued behind it. speed 0 issues every op as soon as a thread is free.
+    double speed = 1;
+};
+
+// Run the ops on index from options.threads client threads. The updates
+// take the index exclusively and the queries share it, so any index whose
+// const methods may run concurrently can be replayed. The ops are issued in
+// capture order, but with several threads they may complete in another one.
+// Kinds of operation missing from Index are skipped.
+template <typename Index, typename T, size_t N>
+ReplayStats replay(Index& index, const std::vector<Op<T, N>>& ops, const ReplayOptions& options = {})
+{
+    using Clock = std::chrono::steady_clock;
+    // Dedicated client threads rather than the shared pool: they sleep
+    // until each op is due, which would stall the pool's workers
+    unsigned nThreads = std::max(1u, options.threads);
+    std::shared_mutex indexLock;
+    std::atomic<size_t> next{0};
+    std::atomic<size_t> skipped{0}, checksum{0};
+    std::vector<ReplayStats> local(nThreads);
+    Clock::time_point start = Clock::now();
+
+    auto client = [&](unsigned t) {
+        ReplayStats& stats = local[t];
+        size_t found = 0, notSupported = 0;
+        for (size_t i; (i = next++) < ops.size();) {
+            const Op<T, N>& op = ops[i];
+            Clock::time_point due = Clock::now();
+            if (options.speed > 0) {
+                due = start + std::chrono::nanoseconds(uint64_t(op.time / options.speed));
+                std::this_thread::sleep_until(due);
+            }
+            bool done = true;
+            switch (op.kind) {
+            case OpKind::Insert:
+                if constexpr (requires { index.insert(op.a); }) {
+                    std::unique_lock<std::shared_mutex> guard(indexLock);
+                    index.insert(op.a);
+                } else done = false;
+                break;
+            case OpKind::Remove:
+                if constexpr (requires { index.remove(op.a); }) {
+                    std::unique_lock<std::shared_mutex> guard(indexLock);
+                    found += index.remove(op.a);
+                } else done = false;
+                break;
+            case OpKind::Search:
+                if constexpr (requires { index.search(op.a); }) {
+                    std::shared_lock<std::shared_mutex> guard(indexLock);
+                    found += index.search(op.a);
+                } else done = false;
+                break;
+            case OpKind::Nearest:
+                if constexpr (requires { index.searchClosestNeighbor(op.a); }) {
+                    std::shared_lock<std::shared_mutex> guard(indexLock);
+                    found += size_t(Point<T, N>::squaredDistance(index.searchClosestNeighbor(op.a), op.a));
+                } else done = false;
+                break;
+            case OpKind::Range:
+                if constexpr (requires { index.searchRange(op.a, op.b); }) {
+                    std::shared_lock<std::shared_mutex> guard(indexLock);
+                    found += index.searchRange(op.a, op.b).size();
+                } else done = false;
+                break;
+            }
+            if (!done) {
+                notSupported++;
+                continue;
+            }
+            stats.latencies[size_t(op.kind)].push_back(
+                std::chrono::duration<double, std::nano>(Clock::now() - due).count());
+        }
+        checksum += found;
+        skipped += notSupported;
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned t = 1; t < nThreads; ++t) threads.emplace_back(client, t);
+    client(0);
+    for (auto& th : threads) th.join();
+
+    ReplayStats stats;
+    stats.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    stats.skipped = skipped;
+    stats.checksum = checksum;
+    for (size_t k = 0; k < nOpKinds; ++k) {
+        for (const ReplayStats& l : local)
+            stats.latencies[k].insert(stats.latencies[k].end(), l.latencies[k].begin(), l.latencies[k].end());
+        std::sort(stats.latencies[k].begin(), stats.latencies[k].end());
+    }
+    return stats;
+}
@@ -0,0 +1,420 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+#include <limits>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include "FilteredKDTree.h"
+#include "HNSWIndex.h"
+#include "IVFIndex.h"
+#include "KDTree.h"
+#include "MortonIndex.h"
+#include "PRQuadTree.h"
+#include "perf_counters.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+// Same workloads on KDTree<int, 2> and PRQuadTree<int>: build by insertion,
+// nearest neighbour queries, range queries, then removal of half the points.
+// MortonIndex<int, 2> is static: bulk build, then the same queries.
+// KDTree after heavy churn: queries before and after compact().
+// Reverse nearest neighbours on KDTree: one query at a time, then in bulk.
+// Minimum spanning tree and closest pair of the points on KDTree.
+// Furthest neighbours and farthest point sampling on KDTree, against brute force.
+// Kernel density on KDTree: naive sum, one query at a time, dual-tree batch.
+// IVFIndex and HNSWIndex on 128-D clustered vectors: recall of the 10 nearest
+// and latency for growing nprobe / efSearch, against exact answers (brute
+// force and KDTree).
+// FilteredKDTree: nearest point of one category out of 16, pruned with the
+// category sets of the nodes or filtered by a predicate only.
+// With TRACE_FILE set, a Chrome trace of the run is written to that file.
+// Each step also reports the hardware counters of the main thread per op
+// (Linux perf_event_open), when the system gives access to them. Steps run
+// on the thread pool show "pool" instead, unless the pool has a single
+// thread: the counters would miss the work of the other workers.
+
+using P = Point<int, 2>;
+
+// Wall time and hardware counters of one step
+struct Measure {
+    double ms;
+    PerfCounters::Counts counts;
+    bool counted;   // false: the counts miss the pool workers
+};
+
+PerfCounters& perfCounters() {
+    static PerfCounters counters;
+    return counters;
+}
+
+// onPool: f forks tasks on the thread pool
+template <typename F>
+Measure measure(F&& f, bool onPool = false) {
+    PerfCounters& counters = perfCounters();
+    counters.start();
+    auto start = std::chrono::steady_clock::now();
+    f();
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    counters.stop();
+    // parallelFor runs on the calling thread when the pool has one thread
+    return {ms, counters.counts(), !onPool || WorkStealingPool::global().size() == 1};
+}
+
+// Time per op, then, when the counters are available, instructions per
+// cycle and cache, branch and dTLB misses per op
+void report(const std::string& name, const Measure& m, int ops) {
+    std::cout << "  " << std::left << std::setw(10) << name << std::right << std::setw(10) << std::fixed
+              << std::setprecision(2) << m.ms << " ms" << std::setw(12) << std::setprecision(1)
+              << m.ms * 1e6 / ops << " ns/op";
+    const PerfCounters& counters = perfCounters();
+    if (counters.anyAvailable() && !m.counted) {
+        std::cout << std::setw(8) << "pool";
+    } else if (counters.anyAvailable()) {
+        using E = PerfCounters;
+        if (counters.available(E::Cycles) && counters.available(E::Instructions) && m.counts[E::Cycles] > 0)
+            std::cout << std::setw(8) << std::setprecision(2) << m.counts[E::Instructions] / m.counts[E::Cycles];
+        else
+            std::cout << std::setw(8) << "-";
+        for (E::Event e : {E::CacheMisses, E::BranchMisses, E::DtlbMisses}) {
+            if (counters.available(e))
+                std::cout << std::setw(10) << std::setprecision(2) << m.counts[e] / ops;
+            else
+                std::cout << std::setw(10) << "-";
+        }
+    }
+    std::cout << "\n";
+}
+
+template <typename Index>
+void run(const std::string& title, Index& index, const std::vector<P>& points,
+         const std::vector<P>& queries, const std::vector<std::pair<P, P>>& boxes) {
+    std::cout << title << "\n";
+    TraceSpan span(Trace::intern(title));
+    report("insert", measure([&] { for (const P& p : points) index.insert(p); }), points.size());
+
+    long checksum = 0;
+    report("nearest", measure([&] {
+        for (const P& q : queries) checksum += index.searchClosestNeighbor(q)[0];
+    }), queries.size());
+
+    long found = 0;
+    report("range", measure([&] {
+        for (const auto& [lo, hi] : boxes) found += index.searchRange(lo, hi).size();
+    }), boxes.size());
+
+    report("remove", measure([&] {
+        for (size_t i = 0; i < points.size(); i += 2) index.remove(points[i]);
+    }), points.size() / 2);
+
+    std::cout << "  (checksum " << checksum << ", " << found << " points in ranges)\n";
+}
+
+void runStatic(const std::string& title, const std::vector<P>& points,
+               const std::vector<P>& queries, const std::vector<std::pair<P, P>>& boxes) {
+    std::cout << title << "\n";
+    TraceSpan span(Trace::intern(title));
+    std::unique_ptr<MortonIndex<int, 2>> index;
+    report("build", measure([&] { index = std::make_unique<MortonIndex<int, 2>>(points); }, true), points.size());
+
+    long checksum = 0;
+    report("nearest", measure([&] {
+        for (const P& q : queries) checksum += index->searchClosestNeighbor(q)[0];
+    }), queries.size());
+
+    long found = 0;
+    report("range", measure([&] {
+        for (const auto& [lo, hi] : boxes) found += index->searchRange(lo, hi).size();
+    }), boxes.size());
+
+    std::cout << "  (checksum " << checksum << ", " << found << " points in ranges)\n";
+}
+
+void runFiltered(const std::vector<P>& points, const std::vector<P>& queries) {
+    const unsigned nCategories = 16;
+    std::cout << "FilteredKDTree<int, 2, int>\n";
+    FilteredKDTree<int, 2, int> index;
+    report("insert", measure([&] {
+        for (size_t i = 0; i < points.size(); ++i) index.insert(points[i], int(i), i % nCategories);
+    }), points.size());
+
+    // A category may hold no point: such queries find nothing
+    long checksum = 0, misses = 0;
+    report("category", measure([&] {
+        for (size_t i = 0; i < queries.size(); ++i) {
+            auto found = index.searchClosestNeighbor(queries[i], index.categoryBit(i % nCategories));
+            if (found) checksum += found->payload;
+            else misses++;
+        }
+    }), queries.size());
+
+    long checksum2 = 0, misses2 = 0;
+    report("predicate", measure([&] {
+        for (size_t i = 0; i < queries.size(); ++i) {
+            unsigned c = i % nCategories;
+            auto found = index.searchClosestNeighbor(queries[i], index.allCategories,
+                [c](const auto& e) { return e.category == c; });
+            if (found) checksum2 += found->payload;
+            else misses2++;
+        }
+    }), queries.size());
+
+    std::cout << "  (checksums " << checksum << ", " << checksum2 << "; " << misses << ", " << misses2
+              << " queries without a match)\n";
+}
+
+void runCompact(const std::vector<P>& points, const std::vector<P>& queries) {
+    std::cout << "KDTree<int, 2> after churn\n";
+    KDTree<int, 2> index;
+    for (const P& p : points) index.insert(p);
+    // Replace every point, interleaving removes and inserts
+    std::mt19937 gen(3);
+    std::uniform_int_distribution<int> dis(0, 29999);
+    std::vector<P> live = points;
+    for (size_t i = 0; i < points.size(); ++i) {
+        index.remove(live[i]);
+        live[i] = P{dis(gen), dis(gen)};
+        index.insert(live[i]);
+    }
+    auto queryAll = [&](const std::string& name) {
+        long checksum = 0;
+        report(name, measure([&] {
+            for (const P& q : queries) checksum += index.searchClosestNeighbor(q)[0];
+            for (const P& q : queries) checksum += index.searchRange(q, P{q[0] + 300, q[1] + 300}).size();
+        }), 2 * queries.size());
+        return checksum;
+    };
+    long c1 = queryAll("scattered");
+    report("compact", measure([&] { index.compact(Layout::DepthFirst); }), points.size());
+    long c2 = queryAll("dfs");
+    report("compact", measure([&] { index.compact(Layout::VanEmdeBoas); }), points.size());
+    long c3 = queryAll("veb");
+    std::cout << "  (checksums " << c1 << ", " << c2 << ", " << c3 << ")\n";
+}
+
+void runReverse(const std::vector<P>& points, const std::vector<P>& queries) {
+    std::cout << "KDTree<int, 2> reverse neighbours\n";
+    KDTree<int, 2> index;
+    for (const P& p : points) index.insert(p);
+    report("prepare", measure([&] { index.prepareReverseNeighbors(); }, true), points.size());
+
+    long found = 0;
+    report("rnn", measure([&] {
+        for (const P& q : queries) found += index.searchReverseNeighbors(q).size();
+    }), queries.size());
+
+    long found2 = 0;
+    report("rnn bulk", measure([&] {
+        for (const auto& r : index.searchReverseNeighbors(queries)) found2 += r.size();
+    }, true), queries.size());
+
+    std::cout << "  (" << found << ", " << found2 << " reverse neighbours)\n";
+}
+
+void runSpanning(const std::vector<P>& points) {
+    std::cout << "KDTree<int, 2> spanning tree\n";
+    KDTree<int, 2> index;
+    for (const P& p : points) index.insert(p);
+    double length = 0;
+    report("emst", measure([&] {
+        for (const auto& e : index.minimumSpanningTree()) length += std::sqrt(double(e.dist2));
+    }, true), points.size());
+    int closest = 0;
+    report("closest", measure([&] { closest = index.closestPair().dist2; }, true), points.size());
+    std::cout << "  (length " << length << ", closest pair at squared distance " << closest << ")\n";
+}
+
+void runSampling(const std::vector<P>& points, const std::vector<P>& queries) {
+    const size_t k = 1000;
+    std::cout << "KDTree<int, 2> furthest neighbours and farthest point sampling\n";
+    KDTree<int, 2> index;
+    for (const P& p : points) index.insert(p);
+    std::vector<P> some(queries.begin(), queries.begin() + queries.size() / 10);
+
+    long naiveSum = 0;
+    report("naive fn", measure([&] {
+        for (const P& q : some) {
+            int best = 0;
+            for (const P& p : points) best = std::max(best, P::squaredDistance(p, q));
+            naiveSum += best;
+        }
+    }), some.size());
+    long treeSum = 0;
+    report("furthest", measure([&] {
+        for (const P& q : some) treeSum += P::squaredDistance(index.searchFurthestNeighbor(q), q);
+    }), some.size());
+
+    // Naive sampling from the same first point: O(n k)
+    std::vector<P> naive{index.farthestPointSampling(1)};
+    report("naive fps", measure([&] {
+        std::vector<int> minDist(points.size(), std::numeric_limits<int>::max());
+        while (naive.size() < k) {
+            size_t next = 0;
+            for (size_t i = 0; i < points.size(); ++i) {
+                minDist[i] = std::min(minDist[i], P::squaredDistance(points[i], naive.back()));
+                if (minDist[i] > minDist[next]) next = i;
+            }
+            naive.push_back(points[next]);
+        }
+    }), k);
+    std::vector<P> samples;
+    report("fps", measure([&] { samples = index.farthestPointSampling(k); }), k);
+    std::cout << "  (sums " << naiveSum << ", " << treeSum << ", " << samples.size() << " samples)\n";
+}
+
+void runDensity(const std::vector<P>& points, const std::vector<P>& queries) {
+    const double bandwidth = 500;
+    std::cout << "KDTree<int, 2> kernel density (Gaussian, 1% error)\n";
+    KDTree<int, 2> index;
+    for (const P& p : points) index.insert(p);
+    std::vector<P> some(queries.begin(), queries.begin() + queries.size() / 10);
+
+    double naive = 0;
+    report("naive", measure([&] {
+        for (const P& q : some)
+            for (const P& p : points) naive += std::exp(-0.5 * P::squaredDistance(p, q) / (bandwidth * bandwidth));
+    }), some.size());
+    naive /= 2 * 3.14159265358979323846 * bandwidth * bandwidth * points.size();
+
+    double single = 0;
+    report("single", measure([&] {
+        for (const P& q : some) single += index.kernelDensity(q, bandwidth);
+    }), some.size());
+
+    double dual = 0;
+    report("dual", measure([&] {
+        for (double d : index.kernelDensity(some, bandwidth)) dual += d;
+    }), some.size());
+
+    std::cout << std::scientific << std::setprecision(6) << "  (sums " << naive << ", " << single << ", "
+              << dual << ")\n";
+}
+
+void runVectors() {
+    const size_t D = 128, n = 50000, nQueries = 200, k = 10, nClusters = 100;
+    using V = Point<float, D>;
+    std::mt19937 gen(7);
+    std::normal_distribution<float> noise(0, 1);
+    std::uniform_real_distribution<float> centre(-10, 10);
+    std::vector<std::array<float, D>> centres(nClusters);
+    for (auto& c : centres)
+        for (float& x : c) x = centre(gen);
+    auto sample = [&] {
+        std::array<float, D> v = centres[gen() % nClusters];
+        for (float& x : v) x += 2 * noise(gen);
+        return V(v);
+    };
+    std::vector<V> points, queries;
+    for (size_t i = 0; i < n; ++i) points.push_back(sample());
+    for (size_t i = 0; i < nQueries; ++i) queries.push_back(sample());
+
+    std::cout << "IVFIndex, HNSWIndex<float, 128> (" << n << " points, 10 nearest)\n";
+    // Exact answers: squared distance of the k-th nearest of each query
+    std::vector<float> kth(nQueries);
+    report("brute", measure([&] {
+        for (size_t q = 0; q < nQueries; ++q) {
+            std::vector<float> d(n);
+            for (size_t i = 0; i < n; ++i) d[i] = V::squaredDistance(queries[q], points[i]);
+            std::nth_element(d.begin(), d.begin() + k - 1, d.end());
+            kth[q] = d[k - 1];
+        }
+    }), nQueries);
+
+    KDTree<float, D> kd;
+    for (const V& p : points) kd.insert(p);
+    report("kdtree 1nn", measure([&] {
+        for (size_t q = 0; q < nQueries / 10; ++q) kd.searchClosestNeighbor(queries[q]);
+    }), nQueries / 10);
+
+    std::unique_ptr<IVFIndex<float, D>> ivf;
+    report("ivf build", measure([&] { ivf = std::make_unique<IVFIndex<float, D>>(points, 256); }, true), n);
+    for (size_t nprobe : {1, 2, 4, 8, 16, 32}) {
+        ivf->setNprobe(nprobe);
+        size_t hits = 0;
+        Measure m = measure([&] {
+            for (size_t q = 0; q < nQueries; ++q)
+                for (const V& p : ivf->searchKNearest(queries[q], k))
+                    hits += V::squaredDistance(queries[q], p) <= kth[q];
+        });
+        report("nprobe " + std::to_string(nprobe), m, nQueries);
+        std::cout << "    recall " << std::setprecision(3) << double(hits) / (nQueries * k) << "\n";
+    }
+
+    HNSWIndex<float, D> hnsw(n, 16, 100);
+    report("hnsw build", measure([&] { hnsw.insert(points); }, true), n);
+    for (size_t ef : {10, 20, 40, 80, 160}) {
+        hnsw.setEfSearch(ef);
+        size_t hits = 0;
+        Measure m = measure([&] {
+            for (size_t q = 0; q < nQueries; ++q)
+                for (const V& p : hnsw.searchKNearest(queries[q], k))
+                    hits += V::squaredDistance(queries[q], p) <= kth[q];
+        });
+        report("ef " + std::to_string(ef), m, nQueries);
+        std::cout << "    recall " << std::setprecision(3) << double(hits) / (nQueries * k) << ", "
+                  << std::setprecision(0) << nQueries * 1000 / m.ms << " queries/s\n";
+    }
+}
+
+int main() {
+    const char* traceFile = std::getenv("TRACE_FILE");
+    if (traceFile) {
+        Trace::setThreadName("main");
+        Trace::start();
+    }
+
+    if (perfCounters().anyAvailable())
+        std::cout << std::setw(51) << "IPC" << std::setw(10) << "cache" << std::setw(10) << "branch"
+                  << std::setw(10) << "dTLB" << "  (misses per op)\n";
+    else
+        std::cout << "Hardware counters unavailable (" << perfCounters().error() << ")\n";
+
+    int n = 100000;
+    // Squared distances must fit in an int
+    int max = 30000;
+    int nQueries = 10000;
+    int boxSide = 300;
+
+    std::mt19937 gen(42);
+    std::uniform_int_distribution<int> dis(0, max - 1);
+    std::uniform_int_distribution<int> corner(0, max - boxSide);
+
+    std::vector<P> points, queries;
+    std::vector<std::pair<P, P>> boxes;
+    for (int i = 0; i < n; ++i) points.push_back({dis(gen), dis(gen)});
+    for (int i = 0; i < nQueries; ++i) queries.push_back({dis(gen), dis(gen)});
+    for (int i = 0; i < nQueries; ++i) {
+        int x = corner(gen), y = corner(gen);
+        boxes.push_back({P{x, y}, P{x + boxSide, y + boxSide}});
+    }
+
+    KDTree<int, 2> kd;
+    run("KDTree<int, 2>", kd, points, queries, boxes);
+
+    PRQuadTree<int> pr(0, 0, max);
+    run("PRQuadTree<int>", pr, points, queries, boxes);
+
+    runStatic("MortonIndex<int, 2>", points, queries, boxes);
+
+    runCompact(points, queries);
+
+    runReverse(points, queries);
+
+    runSpanning(points);
+
+    runSampling(points, queries);
+
+    runDensity(points, queries);
+
+    runFiltered(points, queries);
+
+    runVectors();
+
+    if (traceFile && !Trace::write(traceFile))
+        std::cerr << "Cannot write " << traceFile << "\n";
+    return 0;
+}
@@ -0,0 +1,120 @@
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "KDTree.h"
+#include "PRQuadTree.h"
+#include "Workload.h"
+
+// Capture and replay of KDTree<int, 2> workloads.
+//   kdtree_replay record <file> [ops]
+//     capture a synthetic mix (50k inserts, then nearest, range, search,
+//     insert and remove queries) through a RecordingKDTree
+//   kdtree_replay <file> [threads] [speed]
+//     replay a capture on KDTree<int, 2>, KDTree<int, 2> compacted every
+//     10k updates and PRQuadTree<int>, paced at speed times the captured
+//     rate (0: as fast as possible)
+
+using P = Point<int, 2>;
+
+void record(const std::string& file, size_t nOps) {
+    std::ofstream os(file, std::ios::binary);
+    if (!os) throw std::runtime_error("Cannot write " + file);
+    RecordingKDTree<int, 2> tree(os);
+    std::mt19937 gen(7);
+    std::uniform_int_distribution<int> dis(0, 29999);
+    std::uniform_int_distribution<int> mix(0, 99);
+    std::vector<P> live;
+    size_t preload = std::min<size_t>(nOps, 50000);
+    for (size_t i = 0; i < preload; ++i) {
+        live.push_back({dis(gen), dis(gen)});
+        tree.insert(live.back());
+    }
+    for (size_t i = preload; i < nOps; ++i) {
+        int m = mix(gen);
+        P q{dis(gen), dis(gen)};
+        if (m < 50) {
+            tree.searchClosestNeighbor(q);
+        } else if (m < 70) {
+            tree.searchRange(q, P{q[0] + 300, q[1] + 300});
+        } else if (m < 80) {
+            tree.search(live[gen() % live.size()]);
+        } else if (m < 90 || live.size() < 2) {
+            live.push_back(q);
+            tree.insert(q);
+        } else {
+            size_t k = gen() % live.size();
+            tree.remove(live[k]);
+            live[k] = live.back();
+            live.pop_back();
+        }
+    }
+    std::cout << "Recorded " << nOps << " operations into " << file << "\n";
+}
+
+void report(const std::string& title, const ReplayStats& stats) {
+    std::cout << title << "\n  " << std::fixed << std::setprecision(0) << stats.throughput() << " ops/s, "
+              << stats.count() << " ops, " << stats.skipped << " skipped (checksum " << stats.checksum << ")\n";
+    std::cout << "  " << std::left << std::setw(10) << "latency" << std::right;
+    for (const char* h : {"count", "p50 us", "p90 us", "p99 us", "p99.9 us", "max us"}) std::cout << std::setw(10) << h;
+    std::cout << "\n" << std::setprecision(1);
+    for (size_t k = 0; k < nOpKinds; ++k) {
+        OpKind kind = OpKind(k);
+        if (stats.latencies[k].empty()) continue;
+        std::cout << "  " << std::left << std::setw(10) << opName(kind) << std::right << std::setw(10)
+                  << stats.latencies[k].size();
+        for (double p : {50.0, 90.0, 99.0, 99.9, 100.0}) std::cout << std::setw(10) << stats.percentile(kind, p) / 1000;
+        std::cout << "\n";
+    }
+}
+
+void replayAll(const std::string& file, const ReplayOptions& options) {
+    std::ifstream is(file, std::ios::binary);
+    if (!is) throw std::runtime_error("Cannot read " + file);
+    std::vector<Op<int, 2>> ops = WorkloadReader<int, 2>(is).readAll();
+    if (ops.empty()) throw std::runtime_error("Empty workload");
+    std::cout << ops.size() << " operations over " << ops.back().time / 1e6 << " ms, " << options.threads
+              << " thread(s), speed " << options.speed << "\n";
+
+    KDTree<int, 2> kd;
+    report("KDTree<int, 2>", replay(kd, ops, options));
+
+    KDTree<int, 2> compacted;
+    compacted.setCompactionInterval(10000);
+    report("KDTree<int, 2> compacted every 10k updates", replay(compacted, ops, options));
+
+    // The quadtree needs a region holding every point of the capture
+    int lo = ops[0].a[0], hi = lo;
+    for (const auto& op : ops)
+        for (size_t a = 0; a < 2; ++a) {
+            lo = std::min({lo, op.a[a], op.b[a]});
+            hi = std::max({hi, op.a[a], op.b[a]});
+        }
+    PRQuadTree<int> pr(lo, lo, hi - lo + 1);
+    report("PRQuadTree<int>", replay(pr, ops, options));
+}
+
+int main(int argc, char** argv) {
+    try {
+        if (argc >= 3 && std::string(argv[1]) == "record") {
+            record(argv[2], argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 200000);
+            return 0;
+        }
+        if (argc >= 2) {
+            ReplayOptions options;
+            if (argc > 2) options.threads = unsigned(std::strtoul(argv[2], nullptr, 10));
+            if (argc > 3) options.speed = std::strtod(argv[3], nullptr);
+            replayAll(argv[1], options);
+            return 0;
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+    std::cerr << "Usage: " << argv[0] << " record <file> [ops]\n"
+              << "       " << argv[0] << " <file> [threads] [speed]\n";
+    return 2;
+}
@@ -0,0 +1,134 @@
+#include "perf_counters.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+namespace {
+
+// Open a counter in the group of leader, or a new group leader if leader < 0.
+// Only the leader starts disabled: the members follow it.
+int openCounter(uint32_t type, uint64_t config, int leader)
+{
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = leader < 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return int(syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0));
+}
+
+// Read a group: number of counters, time enabled, time running, then the
+// counts in the order the counters joined the group
+bool readGroup(int leader, uint64_t (&data)[3 + PerfCounters::nEvents])
+{
+    ssize_t n = read(leader, data, sizeof(data));
+    return n >= ssize_t(3 * sizeof(uint64_t)) && n == ssize_t((3 + data[0]) * sizeof(uint64_t));
+}
+
+}
+#endif
+
+PerfCounters::PerfCounters()
+{
+    fds.fill(-1);
+    slots.fill(-1);
+#ifdef __linux__
+    const uint64_t dtlbReadMiss = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    const std::array<std::pair<uint32_t, uint64_t>, nEvents> events = {{
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+        {PERF_TYPE_HW_CACHE, dtlbReadMiss},
+    }};
+    // One group, led by cycles (or the first counter that opens), so that
+    // all the counters cover the same time even when the kernel multiplexes
+    // them, and the ratios between them (e.g. IPC) hold
+    int nSlots = 0;
+    for (int e = 0; e < nEvents; e++) {
+        fds[e] = openCounter(events[e].first, events[e].second, leader);
+        if (fds[e] < 0) {
+            if (why.empty())
+                why = std::string(name(Event(e))) + ": " + std::strerror(errno);
+            continue;
+        }
+        if (leader < 0)
+            leader = fds[e];
+        slots[e] = nSlots++;
+    }
+#else
+    why = "perf_event_open is Linux only";
+#endif
+}
+
+PerfCounters::~PerfCounters()
+{
+#ifdef __linux__
+    for (int fd : fds)
+        if (fd >= 0)
+            close(fd);
+#endif
+}
+
+bool PerfCounters::anyAvailable() const
+{
+    for (int fd : fds)
+        if (fd >= 0)
+            return true;
+    return false;
+}
+
+void PerfCounters::start()
+{
+#ifdef __linux__
+    if (leader < 0)
+        return;
+    // Reset clears the counts but not the times: keep them to scale by the
+    // times of this measure only
+    uint64_t data[3 + nEvents];
+    startEnabled = startRunning = 0;
+    if (readGroup(leader, data)) {
+        startEnabled = data[1];
+        startRunning = data[2];
+    }
+    ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+}
+
+void PerfCounters::stop()
+{
+    values.fill(0);
+#ifdef __linux__
+    if (leader < 0)
+        return;
+    ioctl(leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    uint64_t data[3 + nEvents];
+    if (!readGroup(leader, data) || data[2] <= startRunning)
+        return;     // the group never got on the PMU
+    double scale = double(data[1] - startEnabled) / double(data[2] - startRunning);
+    for (int e = 0; e < nEvents; e++)
+        if (slots[e] >= 0 && uint64_t(slots[e]) < data[0])
+            values[e] = double(data[3 + slots[e]]) * scale;
+#endif
+}
+
+const char* PerfCounters::name(Event e)
+{
+    static const char* names[nEvents] = {"cycles", "instructions", "cache-misses", "branch-misses", "dTLB-load-misses"};
+    return names[e];
+}
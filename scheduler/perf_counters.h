@@ -0,0 +1,59 @@
+/***************************************************************************
+ * Hardware performance counters of the calling thread (Linux perf_event_open)
+ *
+ * Only user space is counted, which perf_event_paranoid <= 2 allows for
+ * one's own threads. A counter the kernel refuses (no PMU in a VM, a
+ * stricter paranoid level, seccomp) is left out and reads 0; on other
+ * systems there is none. The work of other threads (e.g. the workers of
+ * the thread pool) is not counted.  The counters form one group, so they
+ * are scheduled together and their ratios stay meaningful when the kernel
+ * has to multiplex them.
+ ***************************************************************************/
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+
+class PerfCounters {
+public:
+    enum Event { Cycles, Instructions, CacheMisses, BranchMisses, DtlbMisses, nEvents };
+
+    using Counts = std::array<double, nEvents>;
+
+    // Open the counters, stopped
+    PerfCounters();
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    ~PerfCounters();
+
+    bool available(Event e) const { return fds[e] >= 0; }
+
+    bool anyAvailable() const;
+
+    // Why the first missing counter could not be opened
+    const std::string& error() const { return why; }
+
+    // Reset and start counting
+    void start();
+
+    // Stop counting and read the counts
+    void stop();
+
+    // Counts between start() and stop(), extrapolated when the kernel had to
+    // multiplex the counters; 0 for the missing ones
+    const Counts& counts() const { return values; }
+
+    static const char* name(Event e);
+
+private:
+    std::array<int, nEvents> fds;
+    std::array<int, nEvents> slots;     // position of each counter in the group, -1 if missing
+    int leader = -1;                    // fd of the group leader
+    uint64_t startEnabled = 0, startRunning = 0;    // group times at start()
+    Counts values{};
+    std::string why;
+};
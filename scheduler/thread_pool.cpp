@@ -0,0 +1,193 @@
+#include "thread_pool.h"
+#include "trace.h"
+
+#include <algorithm>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace {
+
+struct GlobalOptions {
+    unsigned nThreads = 0;
+    bool pinThreads = false;
+};
+
+GlobalOptions& globalOptions()
+{
+    static GlobalOptions options;
+    return options;
+}
+
+// Bind the thread to one CPU; ignored where not supported
+void pinToCpu(std::thread& t, unsigned cpu)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(t.native_handle(), sizeof(set), &set);
+#else
+    (void)t;
+    (void)cpu;
+#endif
+}
+
+}
+
+WorkStealingPool::WorkStealingPool(unsigned nThreads, bool pinThreads)
+{
+    unsigned nCpus = std::max(1u, std::thread::hardware_concurrency());
+    if (nThreads == 0)
+        nThreads = nCpus;
+    for (unsigned i = 0; i < nThreads; i++)
+        queues.push_back(std::make_unique<Queue>());
+    for (unsigned i = 0; i < nThreads; i++) {
+        workers.emplace_back([this, i] { workerLoop(i); });
+        if (pinThreads)
+            pinToCpu(workers.back(), i % nCpus);
+    }
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        stopping = true;
+    }
+    wakeUp.notify_all();
+    for (std::thread& t : workers)
+        t.join();
+}
+
+void WorkStealingPool::submit(Task task)
+{
+    size_t q = (currentPool() == this) ? currentIndex()
+                                       : nextQueue.fetch_add(1) % queues.size();
+    {
+        // Count under the sleep mutex so that no worker misses the wake-up
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        pending.fetch_add(1);
+    }
+    {
+        std::lock_guard<std::mutex> lock(queues[q]->mutex);
+        queues[q]->tasks.push_back(std::move(task));
+    }
+    wakeUp.notify_one();
+}
+
+bool WorkStealingPool::runPendingTask()
+{
+    Task task;
+    size_t self = (currentPool() == this) ? currentIndex() : 0;
+    if (!popTask(self, task))
+        return false;
+    task();
+    return true;
+}
+
+WorkStealingPool& WorkStealingPool::global()
+{
+    static WorkStealingPool pool(globalOptions().nThreads, globalOptions().pinThreads);
+    return pool;
+}
+
+void WorkStealingPool::configureGlobal(unsigned nThreads, bool pinThreads)
+{
+    globalOptions() = {nThreads, pinThreads};
+}
+
+const WorkStealingPool*& WorkStealingPool::currentPool()
+{
+    static thread_local const WorkStealingPool* pool = nullptr;
+    return pool;
+}
+
+size_t& WorkStealingPool::currentIndex()
+{
+    static thread_local size_t index = 0;
+    return index;
+}
+
+bool WorkStealingPool::popTask(size_t self, Task& task)
+{
+    {
+        Queue& own = *queues[self];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            pending.fetch_sub(1);
+            return true;
+        }
+    }
+    for (size_t k = 1; k < queues.size(); k++) {
+        Queue& victim = *queues[(self + k) % queues.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            pending.fetch_sub(1);
+            return true;
+        }
+    }
+    return false;
+}
+
+void WorkStealingPool::workerLoop(size_t index)
+{
+    currentPool() = this;
+    currentIndex() = index;
+    Trace::setThreadName("worker " + std::to_string(index));
+    Task task;
+    for (;;) {
+        if (popTask(index, task)) {
+            task();
+            task = nullptr;
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        wakeUp.wait(lock, [this] { return stopping || pending.load() > 0; });
+        if (stopping && pending.load() == 0)
+            return;
+    }
+}
+
+void TaskGroup::run(std::function<void()> f)
+{
+    remaining.fetch_add(1);
+    pool.submit([this, f = std::move(f)] {
+        // Count the task done however it ends, or wait() would never return
+        struct Done {
+            std::atomic<size_t>& remaining;
+            ~Done() { remaining.fetch_sub(1); }
+        } done{remaining};
+        try {
+            f();
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(errorMutex);
+            if (!error)
+                error = std::current_exception();
+        }
+    });
+}
+
+void TaskGroup::join()
+{
+    while (remaining.load() > 0)
+        if (!pool.runPendingTask())
+            std::this_thread::yield();
+}
+
+void TaskGroup::wait()
+{
+    join();
+    std::exception_ptr e;
+    {
+        std::lock_guard<std::mutex> lock(errorMutex);
+        std::swap(e, error);
+    }
+    if (e)
+        std::rethrow_exception(e);
+}
@@ -0,0 +1,139 @@
+/***************************************************************************
+ * A small work-stealing thread pool with fork/join task groups
+ *
+ * Each worker owns a deque: it pushes and pops its own tasks at the back
+ * and, when idle, steals from the front of the other workers' deques.
+ * A thread waiting on a TaskGroup keeps executing pending tasks instead
+ * of blocking, so tasks may themselves fork and join sub-tasks.
+ *
+ * Every parallel feature of the project runs on WorkStealingPool::global()
+ * (through TaskGroup or parallelFor), so that they share one set of
+ * threads instead of each starting its own.
+ ***************************************************************************/
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class WorkStealingPool {
+public:
+    using Task = std::function<void()>;
+
+    // Start nThreads workers (0 means one per hardware thread); with
+    // pinThreads, worker i is bound to CPU i (modulo the number of CPUs)
+    explicit WorkStealingPool(unsigned nThreads = 0, bool pinThreads = false);
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    // Stop the workers once every queued task has run
+    ~WorkStealingPool();
+
+    // Number of worker threads
+    size_t size() const { return workers.size(); }
+
+    // Queue a task: on the calling worker's own deque if called from a
+    // task of this pool, otherwise round-robin over the workers
+    void submit(Task task);
+
+    // Run one pending task on the calling thread, if any
+    // Return false if no task could be found
+    bool runPendingTask();
+
+    // The pool shared by the whole program
+    static WorkStealingPool& global();
+
+    // Settings of the global pool; only effective before its first use
+    static void configureGlobal(unsigned nThreads, bool pinThreads);
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+    std::atomic<size_t> nextQueue{0};
+    std::atomic<size_t> pending{0};
+    std::mutex sleepMutex;
+    std::condition_variable wakeUp;
+    bool stopping = false;
+
+    static const WorkStealingPool*& currentPool();
+    static size_t& currentIndex();
+
+    // Pop from the back of our own deque, else steal from the front of another
+    bool popTask(size_t self, Task& task);
+
+    void workerLoop(size_t index);
+};
+
+/*--------------------------------------------------------------------------*
+ * A set of tasks forked on a pool and joined together with wait()
+ *
+ * An exception thrown by a task is caught on the worker; the first one is
+ * rethrown by wait() once all the tasks of the group are done.
+ *--------------------------------------------------------------------------*/
+class TaskGroup {
+public:
+    explicit TaskGroup(WorkStealingPool& pool = WorkStealingPool::global()) : pool(pool) {}
+
+    // Join before destruction so that no task outlives its captures; an
+    // exception not collected by wait() is dropped
+    ~TaskGroup() { join(); }
+
+    // Fork a task
+    void run(std::function<void()> f);
+
+    // Join: help running pending tasks until all tasks of this group are
+    // done, then rethrow the first exception a task threw, if any
+    void wait();
+
+private:
+    WorkStealingPool& pool;
+    std::atomic<size_t> remaining{0};
+    std::mutex errorMutex;
+    std::exception_ptr error;
+
+    void join();
+};
+
+/*--------------------------------------------------------------------------*
+ * Parallel loop
+ *--------------------------------------------------------------------------*/
+template <typename F>
+void parallelForRange(size_t begin, size_t end, size_t grain, const F& f, TaskGroup& tasks)
+{
+    // Fork the upper half while the range is bigger than the grain, so that
+    // thieves take the biggest pieces first
+    while (end - begin > grain) {
+        size_t mid = begin + (end - begin) / 2;
+        tasks.run([mid, end, grain, &f, &tasks] { parallelForRange(mid, end, grain, f, tasks); });
+        end = mid;
+    }
+    for (size_t i = begin; i < end; ++i) f(i);
+}
+
+// Run f(i) for i in [0, n) on the pool, in tasks of at most grain iterations
+template <typename F>
+void parallelFor(size_t n, const F& f, size_t grain = 1, WorkStealingPool& pool = WorkStealingPool::global())
+{
+    if (grain == 0) grain = 1;
+    if (n <= grain || pool.size() == 1) {
+        for (size_t i = 0; i < n; ++i) f(i);
+        return;
+    }
+    TaskGroup tasks(pool);
+    parallelForRange(0, n, grain, f, tasks);
+    tasks.wait();
+}
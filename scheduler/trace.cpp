@@ -0,0 +1,150 @@
+#include "trace.h"
+
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <vector>
+
+namespace {
+
+// Events kept per thread; older ones are overwritten
+const size_t ringSize = 1 << 16;
+
+struct Event {
+    const char* name;
+    uint64_t begin, end;
+    long long n;
+};
+
+struct Ring {
+    std::vector<Event> events;
+    std::atomic<uint64_t> written{0};
+    size_t tid;
+    std::string threadName;
+};
+
+struct Registry {
+    std::mutex mutex;
+    std::vector<std::shared_ptr<Ring>> rings;    // kept after their thread exits
+    std::set<std::string> names;
+    uint64_t epoch = 0;
+};
+
+Registry& registry()
+{
+    static Registry r;
+    return r;
+}
+
+std::string& localThreadName()
+{
+    static thread_local std::string name;
+    return name;
+}
+
+Ring& localRing()
+{
+    static thread_local std::shared_ptr<Ring> ring;
+    if (!ring) {
+        ring = std::make_shared<Ring>();
+        ring->events.resize(ringSize);
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        ring->tid = r.rings.size();
+        ring->threadName = localThreadName().empty() ? "thread " + std::to_string(ring->tid)
+                                                     : localThreadName();
+        r.rings.push_back(ring);
+    }
+    return *ring;
+}
+
+void writeString(std::ostream& os, const std::string& s)
+{
+    os << '"';
+    for (char c : s) {
+        if (c == '"' || c == '\\')
+            os << '\\';
+        os << c;
+    }
+    os << '"';
+}
+
+}
+
+void Trace::start()
+{
+    Registry& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    for (const auto& ring : r.rings)
+        ring->written.store(0, std::memory_order_relaxed);
+    r.epoch = now();
+    recording.store(true, std::memory_order_relaxed);
+}
+
+void Trace::setThreadName(const std::string& name)
+{
+    localThreadName() = name;
+}
+
+const char* Trace::intern(const std::string& name)
+{
+    Registry& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    return r.names.insert(name).first->c_str();
+}
+
+uint64_t Trace::now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Trace::record(const char* name, uint64_t begin, uint64_t end, long long n)
+{
+    Ring& ring = localRing();
+    uint64_t w = ring.written.load(std::memory_order_relaxed);
+    ring.events[w % ringSize] = {name, begin, end, n};
+    ring.written.store(w + 1, std::memory_order_release);
+}
+
+void Trace::write(std::ostream& os)
+{
+    Registry& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    // Timestamps in microseconds since start()
+    auto us = [&](uint64_t t) { return double(int64_t(t - r.epoch)) / 1000; };
+    os << "{\"traceEvents\":[\n" << std::fixed << std::setprecision(3);
+    bool first = true;
+    for (const auto& ring : r.rings) {
+        os << (first ? "" : ",\n") << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":0,\"tid\":" << ring->tid
+           << ",\"args\":{\"name\":";
+        writeString(os, ring->threadName);
+        os << "}}";
+        first = false;
+        uint64_t written = ring->written.load(std::memory_order_acquire);
+        for (uint64_t i = written > ringSize ? written - ringSize : 0; i < written; i++) {
+            const Event& e = ring->events[i % ringSize];
+            if (e.begin < r.epoch)
+                continue;
+            os << ",\n{\"ph\":\"X\",\"name\":";
+            writeString(os, e.name);
+            os << ",\"pid\":0,\"tid\":" << ring->tid << ",\"ts\":" << us(e.begin) << ",\"dur\":" << us(e.end) - us(e.begin);
+            if (e.n >= 0)
+                os << ",\"args\":{\"n\":" << e.n << "}";
+            os << "}";
+        }
+    }
+    os << "\n]}\n";
+}
+
+bool Trace::write(const std::string& path)
+{
+    std::ofstream os(path);
+    if (!os)
+        return false;
+    write(os);
+    return bool(os);
+}
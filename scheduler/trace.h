@@ -0,0 +1,79 @@
+/***************************************************************************
+ * Scoped trace spans, written out as a Chrome trace (chrome://tracing,
+ * ui.perfetto.dev)
+ *
+ * A TraceSpan records the time spent in its scope into a ring buffer
+ * owned by the calling thread, so recording takes no lock. While tracing
+ * is stopped a span only reads one atomic flag. The ring buffers keep
+ * the latest events of each thread; they are allocated on the first
+ * event a thread records.
+ *
+ * Span names must outlive the trace: use string literals or Trace::intern.
+ ***************************************************************************/
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+class Trace {
+public:
+    // Drop the events recorded so far and start recording
+    // Not to be called while traced work is running
+    static void start();
+
+    static void stop() { recording.store(false, std::memory_order_relaxed); }
+
+    static bool enabled() { return recording.load(std::memory_order_relaxed); }
+
+    // Name shown for the calling thread in the trace; to be set before
+    // the thread records its first event
+    static void setThreadName(const std::string& name);
+
+    // A copy of name that lives until the end of the program
+    static const char* intern(const std::string& name);
+
+    // Nanoseconds on a monotonic clock
+    static uint64_t now();
+
+    // Add a complete event to the calling thread's buffer; n (if not
+    // negative) is shown as the "n" argument of the event
+    static void record(const char* name, uint64_t begin, uint64_t end, long long n = -1);
+
+    // Write all the buffered events as Chrome trace JSON
+    // Not to be called while traced work is running
+    static void write(std::ostream& os);
+
+    // Same into a file; return false if it cannot be written
+    static bool write(const std::string& path);
+
+private:
+    static inline std::atomic<bool> recording{false};
+};
+
+/*--------------------------------------------------------------------------*
+ * Records one event covering its lifetime; a null name records nothing,
+ * so that call sites can trace only the big instances of a recursion:
+ *     TraceSpan span(size >= cutoff ? "Encode" : nullptr);
+ *--------------------------------------------------------------------------*/
+class TraceSpan {
+public:
+    explicit TraceSpan(const char* name, long long n = -1)
+        : name(name && Trace::enabled() ? name : nullptr), n(n), begin(this->name ? Trace::now() : 0) {}
+
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+    ~TraceSpan()
+    {
+        if (name)
+            Trace::record(name, begin, Trace::now(), n);
+    }
+
+private:
+    const char* name;
+    long long n;
+    uint64_t begin;
+};